@@ -4,27 +4,36 @@
 -- Bottom-Up β-Substitution: Uplinks and λ-DAGs
 -- By Olin Shivers & Mitchell Wand.  2004.
 
+-- As in the paper, a node's uplinks form a doubly-linked list whose cells are
+-- owned by the parents, one per child slot, so that an uplink is added or
+-- removed in constant time however many parents the node has.
+
 module BUBS 
-    ( Term, eval )
+    ( Term, Config(..), defaultConfig, eval, evalStats )
 where
 
 import qualified HOAS
+import qualified Stats
+import qualified Data.Map as Map
 import Data.IORef
-import Control.Monad (forM_, (<=<), when)
+import Control.Monad (forM, forM_, (<=<), when)
 import Control.Applicative
-import Control.Monad.IO.Class
-import Control.Monad.Trans.Class
-import Control.Monad.Trans.State
-import Control.Monad.Trans.Writer
-import System.Process (system)
+import qualified Data.IntSet as IntSet
+import System.IO (Handle, IOMode(..), hPutStrLn, withFile)
 import Data.Maybe (fromJust, catMaybes)
-import Data.List (delete)
 
 data UplinkType = UplinkAppL | UplinkAppR | UplinkLambda | UplinkVar
     deriving (Eq)
 
 type Uplink a = (UplinkType, NodeRef a)
 
+-- A cell of a node's uplink list.  The parent the uplink leads to owns it.
+data UplinkCell a = UplinkCell {
+    cellUplink :: Uplink a,
+    cellPrev   :: IORef (Maybe (UplinkCell a)),
+    cellNext   :: IORef (Maybe (UplinkCell a))
+  }
+
 data NodeData a
     = AppNode (NodeRef a) (NodeRef a)
     | LambdaNode (NodeRef a) (NodeRef a)
@@ -32,49 +41,163 @@ data NodeData a
     | PrimNode a
 
 data Node a = Node {
+    nodeId :: !Int,                                 -- fresh each time the node is allocated
     nodeCache :: Maybe (NodeRef a),
-    nodeUplinks :: [Uplink a],
+    nodeUplinks :: IORef (Maybe (UplinkCell a)),    -- head of the uplink list
+    nodeCells :: [(UplinkType, UplinkCell a)],      -- one per child slot
     nodeData :: NodeData a
   }
 
 type NodeRef a = IORef (Node a)
 
 
-upcopy :: NodeRef a -> NodeRef a -> Uplink a -> IO ()
-upcopy stop newchild (uplinkType, intoref) | intoref == stop = return ()
-                                           | otherwise = do
-    into <- readIORef intoref
+data Config = Config {
+    cfgNormalize   :: Bool,         -- reduce under lambdas, not just to weak head normal form
+    cfgMemo        :: Bool,         -- share the results of identical redexes
+    cfgTraceGraphs :: Maybe Int     -- reductions between graph snapshots
+  }
 
-    let traverse newnode = mapM_ (upcopy stop newnode) (nodeUplinks into)
-    
-    case nodeData into of
-        AppNode left right -> do
-            case nodeCache into of
-                Nothing -> do
-                    let dat' | UplinkAppL <- uplinkType = AppNode newchild right
-                             | UplinkAppR <- uplinkType = AppNode left newchild
-                    newnode <- newNodeRef dat'
-                    setCache intoref (Just newnode)
-                    traverse newnode
-                Just cache -> do
-                    case uplinkType of
-                        UplinkAppL -> replaceLeft newchild cache
-                        UplinkAppR -> replaceRight newchild cache
-        LambdaNode var body -> do
-            var' <- newNodeRef VarNode
-            lambda' <- newNodeRef (LambdaNode var' newchild)
-            setCache intoref (Just lambda')
-            upcopy lambda' var' (UplinkVar, var)
-            traverse lambda'
-        VarNode -> do
-            setCache intoref (Just newchild)
-            traverse newchild
+defaultConfig :: Config
+defaultConfig = Config { cfgNormalize = False, cfgMemo = False, cfgTraceGraphs = Nothing }
+
+-- The memo table maps the ids of a lambda and an argument to the id and node
+-- of the result of applying one to the other.
+type Memo a = Map.Map (Int, Int) (Int, NodeRef a)
+
+-- Per-evaluation state: the free list, and counters.
+data Heap a = Heap {
+    heapConfig      :: Config,
+    heapFree        :: IORef [NodeRef a],   -- nodes cleanup has let go of
+    heapNextId      :: IORef Int,
+    heapMemo        :: IORef (Memo a),
+    heapMemoHits    :: Stats.Counter,
+    heapMemoStale   :: Stats.Counter,
+    heapFresh       :: Stats.Counter,
+    heapReused      :: Stats.Counter,
+    heapShared      :: Stats.Counter,       -- binders upcopy did not copy
+    heapReductions  :: Stats.Counter,
+    heapUpcopyWork  :: Stats.Counter,
+    heapClearWork   :: Stats.Counter,
+    heapCleanupWork :: Stats.Counter,
+    heapReduceWork  :: Stats.Counter
+  }
+
+newHeap :: Config -> IO (Heap a)
+newHeap cfg = Heap cfg <$> newIORef [] <*> newIORef 0 <*> newIORef Map.empty
+                       <*> counter <*> counter <*> counter <*> counter <*> counter
+                       <*> counter <*> counter <*> counter <*> counter <*> counter
+    where
+    counter = Stats.newCounter
+
+heapStats :: Heap a -> IO Stats.Stats
+heapStats heap = do
+    counts <- Stats.readCounters [ ("bubs.reductions", heapReductions heap)
+                                 , ("bubs.nodes-fresh", heapFresh heap)
+                                 , ("bubs.nodes-reused", heapReused heap)
+                                 , ("bubs.shared-binders", heapShared heap)
+                                 , ("bubs.max-upcopy-work", heapUpcopyWork heap)
+                                 , ("bubs.max-clear-work", heapClearWork heap)
+                                 , ("bubs.max-cleanup-work", heapCleanupWork heap)
+                                 , ("bubs.max-reduce-work", heapReduceWork heap) ]
+    if not (cfgMemo (heapConfig heap)) then return counts else do
+    memo <- Stats.readCounters [ ("bubs.memo-hits", heapMemoHits heap)
+                               , ("bubs.memo-stale", heapMemoStale heap) ]
+    entries <- Map.size <$> readIORef (heapMemo heap)
+    return $ counts ++ memo ++ [ ("bubs.memo-entries", entries) ]
+
+-- The traversals below keep their own worklists rather than recursing, so
+-- that a deep DAG costs heap instead of Haskell stack.  A worklist is a
+-- stack: doing an item gives the items to do next, in order, and they go on
+-- top, so nodes are visited in the order the recursive definitions would
+-- visit them.  peak records the largest the worklist gets.
+work :: Stats.Counter -> (w -> IO [w]) -> w -> IO ()
+work peak step = go 1 . (:[])
+    where
+    go _ [] = return ()
+    go n (w : ws) = do
+        next <- step w
+        let n' = n - 1 + length next
+        Stats.record peak n'
+        go n' (next ++ ws)
+
+-- An upcopy item is the stop node, the new child and the uplink to copy up.
+upcopy :: Heap a -> NodeRef a -> NodeRef a -> Uplink a -> IO ()
+upcopy heap stop0 newchild0 uplink0 = work (heapUpcopyWork heap) step (stop0, newchild0, uplink0)
+    where
+    step (stop, newchild, (uplinkType, intoref))
+        | intoref == stop = return []
+        | otherwise = do
+        into <- readIORef intoref
+
+        let traverse newnode = map ((,,) stop newnode) <$> uplinks intoref
+
+        case nodeData into of
+            AppNode left right -> do
+                case nodeCache into of
+                    Nothing -> do
+                        let dat' | UplinkAppL <- uplinkType = AppNode newchild right
+                                 | UplinkAppR <- uplinkType = AppNode left newchild
+                        newnode <- newNodeRef heap dat'
+                        setCache intoref (Just newnode)
+                        traverse newnode
+                    Just cache -> do
+                        case uplinkType of
+                            UplinkAppL -> replaceLeft newchild cache
+                            UplinkAppR -> replaceRight newchild cache
+                        return []
+            LambdaNode var body -> do
+                -- A lambda whose variable does not occur can share it with
+                -- its copy: there is nothing to copy up from it, and nothing
+                -- will ever be, so neither lambda can see the other's uses.
+                -- Scott-encoded data is full of these.
+                used <- hasUplinks var
+                if not used
+                    then do
+                        Stats.tick (heapShared heap)
+                        lambda' <- newNodeRef heap (LambdaNode var newchild)
+                        setCache intoref (Just lambda')
+                        traverse lambda'
+                    else do
+                        var' <- newNodeRef heap VarNode
+                        lambda' <- newNodeRef heap (LambdaNode var' newchild)
+                        setCache intoref (Just lambda')
+                        ((lambda', var', (UplinkVar, var)) :) <$> traverse lambda'
+            VarNode -> do
+                setCache intoref (Just newchild)
+                traverse newchild
 
 setCache :: NodeRef a -> Maybe (NodeRef a) -> IO ()
 setCache ref newcache = modifyIORef ref (\n -> n { nodeCache = newcache })
 
-newNodeRef :: NodeData a -> IO (NodeRef a)
-newNodeRef dat = newIORef $ Node { nodeCache = Nothing, nodeUplinks = [], nodeData = dat }
+-- newNodeRef takes a node off the free list if there is one.  A node on the
+-- free list has no uplinks, and its cells are in no list, so it keeps those
+-- cells that suit its new data.
+newNodeRef :: Heap a -> NodeData a -> IO (NodeRef a)
+newNodeRef heap dat = do
+    ident <- readIORef (heapNextId heap)
+    writeIORef (heapNextId heap) $! ident + 1
+    free <- readIORef (heapFree heap)
+    case free of
+        ref : rest -> do
+            writeIORef (heapFree heap) rest
+            Stats.tick (heapReused heap)
+            old <- readIORef ref
+            cells <- forM (slots dat) $ \ty ->
+                (,) ty <$> maybe (newCell (ty, ref)) return (lookup ty (nodeCells old))
+            writeIORef ref old { nodeId = ident, nodeCache = Nothing, nodeCells = cells, nodeData = dat }
+            return ref
+        [] -> do
+            Stats.tick (heapFresh heap)
+            uplinkHead <- newIORef Nothing
+            ref <- newIORef $ Node { nodeId = ident, nodeCache = Nothing, nodeUplinks = uplinkHead, nodeCells = [], nodeData = dat }
+            cells <- mapM (\ty -> (,) ty <$> newCell (ty, ref)) (slots dat)
+            modifyIORef ref (\n -> n { nodeCells = cells })
+            return ref
+    where
+    slots (AppNode _ _)    = [UplinkAppL, UplinkAppR]
+    slots (LambdaNode _ _) = [UplinkLambda]
+    slots _                = []
+    newCell uplink = UplinkCell uplink <$> newIORef Nothing <*> newIORef Nothing
 
 replaceLeft :: NodeRef a -> NodeRef a -> IO ()
 replaceLeft newchild node = modifyIORef node $ \n -> n { nodeData = go (nodeData n) }
@@ -91,11 +214,43 @@ replaceBody newchild node = modifyIORef node $ \n -> n { nodeData = go (nodeData
     where
     go (LambdaNode v b) = LambdaNode v newchild
 
+-- uplinkCell finds the cell that stands for uplink in its parent.
+uplinkCell :: Uplink a -> IO (UplinkCell a)
+uplinkCell (ty, parent) = fromJust . lookup ty . nodeCells <$> readIORef parent
+
+-- uplinks lists the uplinks of a node as they are now.
+uplinks :: NodeRef a -> IO [Uplink a]
+uplinks ref = go =<< readIORef . nodeUplinks =<< readIORef ref
+    where
+    go Nothing = return []
+    go (Just cell) = (cellUplink cell :) <$> (go =<< readIORef (cellNext cell))
+
+hasUplinks :: NodeRef a -> IO Bool
+hasUplinks ref = maybe False (const True) <$> (readIORef . nodeUplinks =<< readIORef ref)
+
 addUplink :: Uplink a -> NodeRef a -> IO ()
-addUplink uplink node = modifyIORef node $ \n -> n { nodeUplinks = uplink : nodeUplinks n }
+addUplink uplink node = do
+    cell <- uplinkCell uplink
+    headref <- nodeUplinks <$> readIORef node
+    next <- readIORef headref
+    writeIORef (cellPrev cell) Nothing
+    writeIORef (cellNext cell) next
+    maybe (return ()) (\c -> writeIORef (cellPrev c) (Just cell)) next
+    writeIORef headref (Just cell)
 
 deleteUplink :: Uplink a -> NodeRef a -> IO ()
-deleteUplink uplink node = modifyIORef node $ \n -> n { nodeUplinks = delete uplink (nodeUplinks n) }
+deleteUplink uplink node = do
+    cell <- uplinkCell uplink
+    prev <- readIORef (cellPrev cell)
+    next <- readIORef (cellNext cell)
+    case prev of
+        Nothing -> do
+            headref <- nodeUplinks <$> readIORef node
+            writeIORef headref next
+        Just c -> writeIORef (cellNext c) next
+    maybe (return ()) (\c -> writeIORef (cellPrev c) prev) next
+    writeIORef (cellPrev cell) Nothing
+    writeIORef (cellNext cell) Nothing
 
 getLeft :: NodeRef a -> IO (NodeRef a)
 getLeft ref = (\(AppNode l r) -> l) . nodeData <$> readIORef ref
@@ -106,182 +261,261 @@ getRight ref = (\(AppNode l r) -> r) . nodeData <$> readIORef ref
 getBody :: NodeRef a -> IO (NodeRef a)
 getBody ref = (\(LambdaNode _ b) -> b) . nodeData <$> readIORef ref
 
-clear :: NodeRef a -> IO ()
-clear noderef = do
-    node <- readIORef noderef
-    forM_ (nodeUplinks node) $ \(uplinkType, uplinkRef) -> do
+data ClearItem a
+    = ClearNode (NodeRef a)
+    | ClearUplink (NodeRef a)
+    | ClearCache (NodeRef a)
+
+clear :: Heap a -> NodeRef a -> IO ()
+clear heap = work (heapClearWork heap) step . ClearNode
+    where
+    step (ClearNode noderef) = do
+        ups <- uplinks noderef
+        return $ map (ClearUplink . snd) ups ++ [ClearCache noderef]
+    step (ClearUplink uplinkRef) = do
         upnode <- readIORef uplinkRef
         case nodeCache upnode of
-            Nothing -> return ()
+            Nothing -> return []
             Just cache -> do
                 case nodeData upnode of
                     AppNode _ _ -> do
                         addUplink (UplinkAppL, cache) =<< getLeft cache
                         addUplink (UplinkAppR, cache) =<< getRight cache
                         setCache uplinkRef Nothing
+                        return [ClearNode uplinkRef]
                     LambdaNode var _ -> do
                         addUplink (UplinkLambda, cache) =<< getBody cache
                         setCache uplinkRef Nothing
-                        clear var
-                clear uplinkRef
-    setCache noderef Nothing
-
-cleanup :: NodeRef a -> IO ()
-cleanup noderef = do
-    node <- readIORef noderef
-    when (null (nodeUplinks node)) $ case nodeData node of
-        AppNode left right -> do
-            deleteUplink (UplinkAppL, noderef) left
-            cleanup left
-            deleteUplink (UplinkAppR, noderef) right
-            cleanup right
-        LambdaNode var body -> do
-            deleteUplink (UplinkLambda, noderef) body
-            cleanup body
-        _ -> return ()
-
-upreplace :: NodeRef a -> Uplink a -> IO ()
-upreplace newchild (uplinkType, intoref) = do
+                        return [ClearNode var, ClearNode uplinkRef]
+    step (ClearCache noderef) = do
+        setCache noderef Nothing
+        return []
+
+data CleanupItem a
+    = Cleanup (NodeRef a)
+    | Unlink (Uplink a) (NodeRef a)
+    | Release (NodeRef a)
+
+-- cleanup puts the nodes it detaches on the free list, once their own
+-- uplinks are gone.  Variables are left alone, since the lambda that binds
+-- one refers to it without an uplink.
+cleanup :: Heap a -> NodeRef a -> IO ()
+cleanup heap = work (heapCleanupWork heap) step . Cleanup
+    where
+    step (Unlink uplink child) = do
+        deleteUplink uplink child
+        return []
+    step (Release noderef) = do
+        modifyIORef (heapFree heap) (noderef :)
+        return []
+    step (Cleanup noderef) = do
+        node <- readIORef noderef
+        used <- hasUplinks noderef
+        return $ if used then [] else case nodeData node of
+            AppNode left right ->
+                [ Unlink (UplinkAppL, noderef) left, Cleanup left
+                , Unlink (UplinkAppR, noderef) right, Cleanup right
+                , Release noderef ]
+            LambdaNode var body ->
+                [ Unlink (UplinkLambda, noderef) body, Cleanup body
+                , Release noderef ]
+            PrimNode _ -> [Release noderef]
+            VarNode -> []
+
+upreplace :: Heap a -> NodeRef a -> Uplink a -> IO ()
+upreplace heap newchild (uplinkType, intoref) = do
     into <- readIORef intoref
     case (nodeData into, uplinkType) of
         (AppNode left right, UplinkAppL) -> do
             deleteUplink (UplinkAppL, intoref) left
             replaceLeft newchild intoref
             addUplink (UplinkAppL, intoref) newchild
-            cleanup left
+            cleanup heap left
         (AppNode left right, UplinkAppR) -> do
             deleteUplink (UplinkAppR, intoref) right
             replaceRight newchild intoref
             addUplink (UplinkAppR, intoref) newchild
-            cleanup right
+            cleanup heap right
         (LambdaNode var body, UplinkLambda) -> do
             deleteUplink (UplinkLambda, intoref) body
             replaceBody newchild intoref
             addUplink (UplinkLambda, intoref) newchild
-            cleanup body
+            cleanup heap body
             
 
-betaReduce :: NodeRef a -> IO (NodeRef a)
-betaReduce appref = do
+betaReduce :: Heap a -> NodeRef a -> IO (NodeRef a)
+betaReduce heap appref = do
     app <- readIORef appref
     let AppNode leftref rightref = nodeData app
     left <- readIORef leftref
     let LambdaNode varref bodyref = nodeData left
-    var <- readIORef varref
-    result <- case nodeUplinks var of
-        [] -> return bodyref
-        _ -> do
-            upcopy leftref rightref (UplinkVar, varref)
-            result <- fromJust . nodeCache <$> (readIORef =<< getBody leftref)
-            setCache leftref Nothing
-            clear varref
-            return result
-    mapM_ (upreplace result) =<< nodeUplinks <$> readIORef appref
+    used <- hasUplinks varref
+    result <- if not used then return bodyref else do
+        upcopy heap leftref rightref (UplinkVar, varref)
+        result <- fromJust . nodeCache <$> (readIORef =<< getBody leftref)
+        setCache leftref Nothing
+        clear heap varref
+        return result
+    mapM_ (upreplace heap result) =<< uplinks appref
     return result
 
-hnfReduce :: (HOAS.Primitive a) => NodeRef a -> IO ()
-hnfReduce noderef = do
-    node <- readIORef noderef
-    case nodeData node of
-        LambdaNode var body -> hnfReduce body 
-        AppNode left right -> do
-            hnfReduce left
-            left' <- readIORef =<< getLeft noderef 
-            case nodeData left' of
-                LambdaNode {} -> hnfReduce =<< betaReduce noderef
-                PrimNode p -> do
-                    hnfReduce right
-                    right' <- readIORef =<< getRight noderef
-                    case nodeData right' of
-                        PrimNode p' -> do
-                            result <- newNodeRef $ PrimNode (p `HOAS.apply` p')
-                            mapM_ (upreplace result) =<< nodeUplinks <$> readIORef noderef
-                        _ -> return ()
-                _ -> return ()
-        _ -> return ()
-
-graphviz :: (HOAS.Primitive a) => NodeRef a -> IO String
-graphviz noderef_ = do
-    output <- evalStateT (execWriterT (go noderef_)) ([], 0)
-    return $ "digraph Lambda {\n" ++ output ++ "}\n"
-    where
-    go noderef = do
-        cached <- lift $ gets (lookup noderef . fst)
-        case cached of
-            Just ident -> return ident
+-- memoBetaReduce is betaReduce going through the memo table when cfgMemo is
+-- set.  An entry is only good while its result is still in the graph: once
+-- cleanup has let go of the result, the result may have been reduced further
+-- and replaced, or freed and allocated again, so hits check that it still has
+-- uplinks and the same id.  Lambda and argument are identified by id, which
+-- a recycled node does not keep, so the key cannot be confused either.
+memoBetaReduce :: Heap a -> NodeRef a -> IO (NodeRef a)
+memoBetaReduce heap appref
+    | not (cfgMemo (heapConfig heap)) = betaReduce heap appref
+    | otherwise = do
+        key <- (,) <$> (idOf =<< getLeft appref) <*> (idOf =<< getRight appref)
+        memo <- readIORef (heapMemo heap)
+        hit <- case Map.lookup key memo of
+            Nothing -> return Nothing
+            Just (ident, result) -> do
+                valid <- (&&) <$> ((== ident) <$> idOf result) <*> hasUplinks result
+                if valid then return (Just result) else do
+                    Stats.tick (heapMemoStale heap)
+                    return Nothing
+        case hit of
+            Just result -> do
+                Stats.tick (heapMemoHits heap)
+                mapM_ (upreplace heap result) =<< uplinks appref
+                return result
             Nothing -> do
-                (seen, ident) <- lift get
-                lift $ put ((noderef,ident):seen, ident+1)
-                node <- liftIO $ readIORef noderef
-                let color | noderef == noderef_ = "color=orange,style=filled"
-                          | otherwise           = "colorblack"
-                forM_ (nodeUplinks node) $ \(ty, uplink) -> do
-                    uplinkid <- go uplink
-                    tell $ "p" ++ show ident ++ " -> p" ++ show uplinkid ++ " [weight=1,color=red];\n"
-                case nodeData node of
-                    AppNode left right -> do
-                        tell $ "p" ++ show ident ++ " [label=\"*\"," ++ color ++ "];\n"
-                        leftid <- go left
-                        tell $ "p" ++ show ident ++ " -> p" ++ show leftid ++ " [weight=1,color=\"#007f00\",label=\"fv\"];\n"
-                        rightid <- go right
-                        tell $ "p" ++ show ident ++ " -> p" ++ show rightid ++ " [weight=1,label=\"av\"];\n"
-                    LambdaNode var body -> do
-                        tell $ "p" ++ show ident ++ " [label=\"\\\\\"," ++ color ++ "];\n"
-                        bodyid <- go body
-                        tell $ "p" ++ show ident ++ " -> p" ++ show bodyid ++ " [weight=1];\n"
-                        varid <- go var
-                        tell $ "p" ++ show ident ++ " -> p" ++ show varid ++ " [weight=0,color=blue];\n"
-                    VarNode -> do
-                        tell $ "p" ++ show ident ++ " [label=\"x\"," ++ color ++ "];\n"
-                    PrimNode x -> do
-                        tell $ "p" ++ show ident ++ " [label=\"" ++ show x ++ "\"];\n"
-                case nodeCache node of
-                    Just cacher -> do
-                        cacheid <- go cacher
-                        tell $ "p" ++ show ident ++ " -> p" ++ show cacheid ++ " [weight=0,style=dotted];\n"
-                    Nothing -> return ()
-                return ident
-
-runGraphviz :: (HOAS.Primitive a) => NodeRef a -> IO ()
-runGraphviz node = do
-    writeFile "graph.dot" =<< graphviz node
-    system "dot -T png -o graph.png graph.dot"
-    system "eog graph.png"
-    return ()
-
-eval :: (HOAS.Primitive a) => Term a -> IO a
-eval t = do
-    noderef <- getTerm $ fun (\z -> t)
-    hnfReduce noderef
+                result <- betaReduce heap appref
+                ident <- idOf result
+                modifyIORef (heapMemo heap) (Map.insert key (ident, result))
+                return result
+    where
+    idOf ref = nodeId <$> readIORef ref
+
+-- Reduce n reduces n; ReduceFun and ReduceArg carry on with the application
+-- n once its function, and then its argument, have been reduced.  They read
+-- n's children afresh: reducing the function may have replaced, and freed,
+-- what they were.
+--
+-- Only with cfgNormalize does reduction go under lambdas.  Otherwise it does
+-- what the result needs: a function to weak head normal form, and the
+-- argument of a primitive.  Arguments are shared, so each is reduced at most
+-- once, wherever it is used.
+data Reduction a
+    = Reduce (NodeRef a)
+    | ReduceFun (NodeRef a)
+    | ReduceArg (NodeRef a) a               -- application, its function
+
+-- hnfReduce reduces start, somewhere under root.
+hnfReduce :: (HOAS.Primitive a) => Heap a -> NodeRef a -> NodeRef a -> IO ()
+hnfReduce heap root = work (heapReduceWork heap) step . Reduce
+    where
+    step (Reduce noderef) = do
+        node <- readIORef noderef
+        return $ case nodeData node of
+            LambdaNode var body | cfgNormalize (heapConfig heap) -> [Reduce body]
+            AppNode left right -> [Reduce left, ReduceFun noderef]
+            _ -> []
+    step (ReduceFun noderef) = do
+        left' <- readIORef =<< getLeft noderef
+        case nodeData left' of
+            LambdaNode {} -> do
+                result <- memoBetaReduce heap noderef
+                snapshot heap root
+                return [Reduce result]
+            PrimNode p -> do
+                right <- getRight noderef
+                return [Reduce right, ReduceArg noderef p]
+            _ -> return []
+    step (ReduceArg noderef p) = do
+        right' <- readIORef =<< getRight noderef
+        case nodeData right' of
+            PrimNode p' -> do
+                result <- newNodeRef heap $ PrimNode (p `HOAS.apply` p')
+                mapM_ (upreplace heap result) =<< uplinks noderef
+            _ -> return ()
+        return []
+
+-- graphviz writes the graph reachable from root to h in dot syntax, in time
+-- linear in its size.  Nodes are named by their ids, so an edge can be
+-- written before the node it leads to, and a set of ids is all it takes to
+-- write each node once.  Uplinks are left out, as they are just the child
+-- edges turned around.
+graphviz :: (HOAS.Primitive a) => Handle -> NodeRef a -> IO ()
+graphviz h root = do
+    hPutStrLn h "digraph Lambda {"
+    go IntSet.empty [root]
+    hPutStrLn h "}"
+    where
+    go _ [] = return ()
+    go seen (ref : refs) = do
+        node <- readIORef ref
+        let ident = nodeId node
+        if IntSet.member ident seen then go seen refs else do
+        let (label, edges) = case nodeData node of
+                AppNode left right  -> ("*", [(left, "color=\"#007f00\""), (right, "")])
+                LambdaNode var body -> ("\\\\", [(body, ""), (var, "weight=0,color=blue")])
+                VarNode             -> ("x", [])
+                PrimNode x          -> (show x, [])
+            cache = [ (c, "weight=0,style=dotted") | Just c <- [nodeCache node] ]
+            color | ref == root = ",color=orange,style=filled"
+                  | otherwise   = ""
+        hPutStrLn h $ "p" ++ show ident ++ " [label=\"" ++ label ++ "\"" ++ color ++ "];"
+        forM_ (edges ++ cache) $ \(to, attrs) -> do
+            toId <- nodeId <$> readIORef to
+            hPutStrLn h $ "p" ++ show ident ++ " -> p" ++ show toId ++ " [" ++ attrs ++ "];"
+        go (IntSet.insert ident seen) (map fst (edges ++ cache) ++ refs)
+
+-- snapshot counts a reduction, and with cfgTraceGraphs every n of them
+-- writes the graph under root to bubs-<count>.dot.
+snapshot :: (HOAS.Primitive a) => Heap a -> NodeRef a -> IO ()
+snapshot heap root = do
+    Stats.tick (heapReductions heap)
+    case cfgTraceGraphs (heapConfig heap) of
+        Nothing -> return ()
+        Just every -> do
+            n <- Stats.readCounter (heapReductions heap)
+            when (n `mod` every == 0) $
+                withFile ("bubs-" ++ show n ++ ".dot") WriteMode $ \h -> graphviz h root
+
+-- The term is put under a lambda, so that it has a parent slot to be
+-- replaced in like any other redex.
+evalStats :: (HOAS.Primitive a) => Config -> Term a -> IO (a, Stats.Stats)
+evalStats cfg t = do
+    heap <- newHeap cfg
+    noderef <- getTerm (fun (\z -> t)) heap
+    hnfReduce heap noderef =<< getBody noderef
     dat <- nodeData <$> (readIORef =<< getBody noderef)
     case dat of
-        PrimNode p -> return p
+        PrimNode p -> (,) p <$> heapStats heap
         _ -> fail "Not a primitive!"
+
+eval :: (HOAS.Primitive a) => Term a -> IO a
+eval = fmap fst . evalStats defaultConfig
     
 
-newtype Term a = Term { getTerm :: IO (NodeRef a) }
+newtype Term a = Term { getTerm :: Heap a -> IO (NodeRef a) }
 
 infixl 9 %
 (%) :: Term a -> Term a -> Term a
-Term left % Term right = Term $ do
-    left' <- left
-    right' <- right
-    newref <- newNodeRef $ AppNode left' right'
+Term left % Term right = Term $ \heap -> do
+    left' <- left heap
+    right' <- right heap
+    newref <- newNodeRef heap $ AppNode left' right'
     addUplink (UplinkAppL, newref) left'
     addUplink (UplinkAppR, newref) right'
     return newref
 
 fun :: (Term a -> Term a) -> Term a
-fun bodyf = Term $ do
-    var <- newNodeRef $ VarNode
-    body <- getTerm . bodyf . Term $ return var
-    newref <- newNodeRef $ LambdaNode var body
+fun bodyf = Term $ \heap -> do
+    var <- newNodeRef heap $ VarNode
+    body <- getTerm (bodyf (Term (\_ -> return var))) heap
+    newref <- newNodeRef heap $ LambdaNode var body
     addUplink (UplinkLambda, newref) body
     return newref
 
 prim :: a -> Term a
-prim x = Term $ do
-    newref <- newNodeRef $ PrimNode x
+prim x = Term $ \heap -> do
+    newref <- newNodeRef heap $ PrimNode x
     return newref
 
 instance HOAS.Term (Term a) where
@@ -0,0 +1,325 @@
+{-# LANGUAGE FlexibleInstances, MultiParamTypeClasses #-}
+
+-- Bottom-up beta substitution (see BUBS.hs) over a struct-of-arrays node
+-- store.  Nodes are Int indices into unboxed columns for the tag, the two
+-- children, the cache and the head of the uplink list, and every change is a
+-- write into a column rather than a fresh Node record.  Only primitive values
+-- are boxed, in a table of their own.
+--
+-- The uplink list cells are numbered as well: node n owns cells 2n and 2n+1,
+-- for its left (or body) and right slots, so the uplink a cell stands for is
+-- given by its number and the tag of its parent.
+
+module BUBSArena (Term, eval, evalStats) where
+
+import qualified HOAS
+import qualified Column
+import qualified Stats
+import Data.IORef
+import Control.Applicative
+import Control.Monad (forM_, when)
+
+type NodeIx = Int
+type CellIx = Int
+
+-- The null node or cell.
+none :: Int
+none = -1
+
+tagApp, tagLambda, tagVar, tagPrim :: Int
+tagApp    = 0
+tagLambda = 1
+tagVar    = 2
+tagPrim   = 3
+
+-- App:    left = function, right = argument
+-- Lambda: left = body, right = var
+-- Prim:   left = index into arenaPrims
+data Arena a = Arena {
+    arenaSize      :: IORef Int,
+    arenaCapacity  :: IORef Int,
+    arenaTag       :: Column.UColumn Int,
+    arenaLeft      :: Column.UColumn Int,
+    arenaRight     :: Column.UColumn Int,
+    arenaCache     :: Column.UColumn Int,
+    arenaUplinks   :: Column.UColumn Int,    -- first cell of the uplink list
+    arenaCellPrev  :: Column.UColumn Int,
+    arenaCellNext  :: Column.UColumn Int,
+    arenaPrims     :: Column.BColumn a,
+    arenaPrimCount :: IORef Int
+  }
+
+data UplinkType = UplinkAppL | UplinkAppR | UplinkLambda | UplinkVar
+    deriving (Eq)
+
+type Uplink = (UplinkType, NodeIx)
+
+initialCapacity :: Int
+initialCapacity = 1024
+
+newArena :: IO (Arena a)
+newArena = Arena
+    <$> newIORef 0 <*> newIORef initialCapacity
+    <*> col <*> col <*> col <*> col <*> col
+    <*> cellCol <*> cellCol
+    <*> Column.new 64 <*> newIORef 0
+    where
+    col = Column.new initialCapacity
+    cellCol = Column.new (2 * initialCapacity)
+
+nodeColumns :: Arena a -> [Column.UColumn Int]
+nodeColumns arena = [ arenaTag arena, arenaLeft arena, arenaRight arena
+                    , arenaCache arena, arenaUplinks arena ]
+
+arenaStats :: Arena a -> IO Stats.Stats
+arenaStats arena = do
+    size <- readIORef (arenaSize arena)
+    cap <- readIORef (arenaCapacity arena)
+    return [ ("bubs-arena.nodes", size)
+           , ("bubs-arena.capacity", cap) ]
+
+alloc :: Arena a -> Int -> Int -> Int -> IO NodeIx
+alloc arena tag left right = do
+    ix <- readIORef (arenaSize arena)
+    writeIORef (arenaSize arena) $! ix + 1
+    cap <- readIORef (arenaCapacity arena)
+    when (ix >= cap) $ do
+        let cap' = 2 * cap
+        forM_ (nodeColumns arena) $ \c -> Column.grow c (cap' - 1)
+        Column.grow (arenaCellPrev arena) (2 * cap' - 1)
+        Column.grow (arenaCellNext arena) (2 * cap' - 1)
+        writeIORef (arenaCapacity arena) cap'
+    Column.write (arenaTag arena) ix tag
+    Column.write (arenaLeft arena) ix left
+    Column.write (arenaRight arena) ix right
+    Column.write (arenaCache arena) ix none
+    Column.write (arenaUplinks arena) ix none
+    return ix
+
+newPrim :: Arena a -> a -> IO NodeIx
+newPrim arena p = do
+    slot <- readIORef (arenaPrimCount arena)
+    writeIORef (arenaPrimCount arena) $! slot + 1
+    Column.grow (arenaPrims arena) slot
+    Column.write (arenaPrims arena) slot p
+    alloc arena tagPrim slot none
+
+tagOf, getLeft, getRight, getCache :: Arena a -> NodeIx -> IO Int
+tagOf    = Column.read . arenaTag
+getLeft  = Column.read . arenaLeft
+getRight = Column.read . arenaRight
+getCache = Column.read . arenaCache
+
+setCache :: Arena a -> NodeIx -> NodeIx -> IO ()
+setCache = Column.write . arenaCache
+
+primOf :: Arena a -> NodeIx -> IO a
+primOf arena ix = Column.read (arenaPrims arena) =<< getLeft arena ix
+
+-- The cell that stands for uplink, and the uplink a cell stands for.
+uplinkCell :: Uplink -> CellIx
+uplinkCell (UplinkAppR, parent) = 2 * parent + 1
+uplinkCell (_, parent)          = 2 * parent
+
+cellUplink :: Arena a -> CellIx -> IO Uplink
+cellUplink arena cell = do
+    let (parent, slot) = cell `divMod` 2
+    tag <- tagOf arena parent
+    let ty | slot == 1      = UplinkAppR
+           | tag == tagApp  = UplinkAppL
+           | otherwise      = UplinkLambda
+    return (ty, parent)
+
+-- uplinks lists the uplinks of a node as they are now.
+uplinks :: Arena a -> NodeIx -> IO [Uplink]
+uplinks arena ix = go =<< Column.read (arenaUplinks arena) ix
+    where
+    go cell | cell == none = return []
+            | otherwise    = (:) <$> cellUplink arena cell <*> (go =<< Column.read (arenaCellNext arena) cell)
+
+hasUplinks :: Arena a -> NodeIx -> IO Bool
+hasUplinks arena ix = (/= none) <$> Column.read (arenaUplinks arena) ix
+
+addUplink :: Arena a -> Uplink -> NodeIx -> IO ()
+addUplink arena uplink ix = do
+    let cell = uplinkCell uplink
+    next <- Column.read (arenaUplinks arena) ix
+    Column.write (arenaCellPrev arena) cell none
+    Column.write (arenaCellNext arena) cell next
+    when (next /= none) $ Column.write (arenaCellPrev arena) next cell
+    Column.write (arenaUplinks arena) ix cell
+
+deleteUplink :: Arena a -> Uplink -> NodeIx -> IO ()
+deleteUplink arena uplink ix = do
+    let cell = uplinkCell uplink
+    prev <- Column.read (arenaCellPrev arena) cell
+    next <- Column.read (arenaCellNext arena) cell
+    if prev == none
+        then Column.write (arenaUplinks arena) ix next
+        else Column.write (arenaCellNext arena) prev next
+    when (next /= none) $ Column.write (arenaCellPrev arena) next prev
+
+upcopy :: Arena a -> NodeIx -> NodeIx -> Uplink -> IO ()
+upcopy arena stop newchild (uplinkType, into)
+    | into == stop = return ()
+    | otherwise = do
+        tag <- tagOf arena into
+        let traverse newnode = mapM_ (upcopy arena stop newnode) =<< uplinks arena into
+        case () of
+            _ | tag == tagApp -> do
+                  cache <- getCache arena into
+                  if cache /= none
+                      then case uplinkType of
+                          UplinkAppL -> Column.write (arenaLeft arena) cache newchild
+                          _          -> Column.write (arenaRight arena) cache newchild
+                      else do
+                          left <- getLeft arena into
+                          right <- getRight arena into
+                          newnode <- case uplinkType of
+                              UplinkAppL -> alloc arena tagApp newchild right
+                              _          -> alloc arena tagApp left newchild
+                          setCache arena into newnode
+                          traverse newnode
+              | tag == tagLambda -> do
+                  var <- getRight arena into
+                  var' <- alloc arena tagVar none none
+                  lambda' <- alloc arena tagLambda newchild var'
+                  setCache arena into lambda'
+                  upcopy arena lambda' var' (UplinkVar, var)
+                  traverse lambda'
+              | tag == tagVar -> do
+                  setCache arena into newchild
+                  traverse newchild
+              | otherwise -> return ()
+
+clear :: Arena a -> NodeIx -> IO ()
+clear arena ix = do
+    ups <- uplinks arena ix
+    forM_ ups $ \(_, up) -> do
+        cache <- getCache arena up
+        when (cache /= none) $ do
+            tag <- tagOf arena up
+            if tag == tagApp
+                then do
+                    addUplink arena (UplinkAppL, cache) =<< getLeft arena cache
+                    addUplink arena (UplinkAppR, cache) =<< getRight arena cache
+                    setCache arena up none
+                else do
+                    addUplink arena (UplinkLambda, cache) =<< getLeft arena cache
+                    setCache arena up none
+                    clear arena =<< getRight arena up
+            clear arena up
+    setCache arena ix none
+
+cleanup :: Arena a -> NodeIx -> IO ()
+cleanup arena ix = do
+    used <- hasUplinks arena ix
+    tag <- tagOf arena ix
+    when (not used) $ case () of
+        _ | tag == tagApp -> do
+              left <- getLeft arena ix
+              right <- getRight arena ix
+              deleteUplink arena (UplinkAppL, ix) left
+              cleanup arena left
+              deleteUplink arena (UplinkAppR, ix) right
+              cleanup arena right
+          | tag == tagLambda -> do
+              body <- getLeft arena ix
+              deleteUplink arena (UplinkLambda, ix) body
+              cleanup arena body
+          | otherwise -> return ()
+
+upreplace :: Arena a -> NodeIx -> Uplink -> IO ()
+upreplace arena newchild uplink@(uplinkType, into) = do
+    let column | uplinkType == UplinkAppR = arenaRight arena
+               | otherwise                = arenaLeft arena
+    old <- Column.read column into
+    deleteUplink arena uplink old
+    Column.write column into newchild
+    addUplink arena uplink newchild
+    cleanup arena old
+
+betaReduce :: Arena a -> NodeIx -> IO NodeIx
+betaReduce arena app = do
+    lambda <- getLeft arena app
+    arg <- getRight arena app
+    body <- getLeft arena lambda
+    var <- getRight arena lambda
+    used <- hasUplinks arena var
+    result <- if not used then return body else do
+        upcopy arena lambda arg (UplinkVar, var)
+        result <- getCache arena body
+        setCache arena lambda none
+        clear arena var
+        return result
+    mapM_ (upreplace arena result) =<< uplinks arena app
+    return result
+
+hnfReduce :: (HOAS.Primitive a) => Arena a -> NodeIx -> IO ()
+hnfReduce arena ix = do
+    tag <- tagOf arena ix
+    case () of
+        _ | tag == tagLambda -> hnfReduce arena =<< getLeft arena ix
+          | tag == tagApp -> do
+              hnfReduce arena =<< getLeft arena ix
+              left <- getLeft arena ix
+              lefttag <- tagOf arena left
+              case () of
+                  _ | lefttag == tagLambda -> hnfReduce arena =<< betaReduce arena ix
+                    | lefttag == tagPrim -> do
+                        hnfReduce arena =<< getRight arena ix
+                        right <- getRight arena ix
+                        righttag <- tagOf arena right
+                        when (righttag == tagPrim) $ do
+                            p <- primOf arena left
+                            p' <- primOf arena right
+                            result <- newPrim arena (p `HOAS.apply` p')
+                            mapM_ (upreplace arena result) =<< uplinks arena ix
+                    | otherwise -> return ()
+          | otherwise -> return ()
+
+evalStats :: (HOAS.Primitive a) => Term a -> IO (a, Stats.Stats)
+evalStats t = do
+    arena <- newArena
+    ix <- getTerm (fun (\_ -> t)) arena
+    hnfReduce arena ix
+    body <- getLeft arena ix
+    tag <- tagOf arena body
+    if tag /= tagPrim then fail "Not a primitive!" else do
+    p <- primOf arena body
+    stats <- arenaStats arena
+    return (p, stats)
+
+eval :: (HOAS.Primitive a) => Term a -> IO a
+eval = fmap fst . evalStats
+
+
+newtype Term a = Term { getTerm :: Arena a -> IO NodeIx }
+
+infixl 9 %
+(%) :: Term a -> Term a -> Term a
+Term left % Term right = Term $ \arena -> do
+    left' <- left arena
+    right' <- right arena
+    ix <- alloc arena tagApp left' right'
+    addUplink arena (UplinkAppL, ix) left'
+    addUplink arena (UplinkAppR, ix) right'
+    return ix
+
+fun :: (Term a -> Term a) -> Term a
+fun bodyf = Term $ \arena -> do
+    var <- alloc arena tagVar none none
+    body <- getTerm (bodyf (Term (\_ -> return var))) arena
+    ix <- alloc arena tagLambda body var
+    addUplink arena (UplinkLambda, ix) body
+    return ix
+
+prim :: a -> Term a
+prim x = Term $ \arena -> newPrim arena x
+
+instance HOAS.Term (Term a) where
+    (%) = (%)
+    fun = fun
+
+instance HOAS.PrimTerm a (Term a) where
+    prim = prim
@@ -0,0 +1,380 @@
+-- A bytecode machine: the lazy Krivine machine of Krivine.hs, with terms
+-- compiled to a flat array of Ints.
+--
+--   ACCESS n   enter the closure in slot n of the environment
+--   GRAB       pop the argument on the stack into slot 0 of the environment
+--   PUSH l     push the code at l, with the environment, as an argument
+--   PUSHVAR n  push the closure in slot n of the environment as an argument
+--   PRIM k     return the k-th constant
+--
+-- An application is a PUSH of its argument, or a PUSHVAR if the argument is
+-- a variable, followed by the code of its function, and a lambda is a GRAB
+-- followed by its body, so every sequence ends in an ACCESS or a PRIM.  The stack is an unboxed array of frames of
+-- two Ints: an argument, a heap cell to update, or a primitive (in a heap
+-- cell) waiting for its argument.  The heap is in columns, as in
+-- BUBSArena, and environments are lists of heap cells.  Cells are reused:
+-- when the heap is full, those that the stack and the environment being run
+-- in cannot reach are collected.
+--
+-- A program can be saved to a file and loaded back with a single read of its
+-- code, which is checked before it is run.
+
+module Bytecode (Program, compile, save, load, eval, evalStats) where
+
+import DeBruijn (Exp(..))
+import qualified HOAS
+import qualified Column
+import qualified Stats
+import Data.Array
+import Data.Array.Unboxed (UArray)
+import qualified Data.Array.Unboxed as UArray
+import Data.Array.Base (unsafeAt)
+import Data.Array.Storable (StorableArray, withStorableArray)
+import Data.Array.MArray (newListArray, newArray, newArray_, readArray, writeArray, freeze)
+import Data.Array.IO (IOUArray)
+import qualified Data.IntMap as IntMap
+import qualified Data.IntSet as IntSet
+import Data.IORef
+import Foreign.Storable (sizeOf)
+import GHC.ByteOrder (targetByteOrder)
+import System.IO
+import Control.Applicative
+import Control.Monad (when, filterM, forM_)
+import Control.Monad.Trans.State.Strict
+
+data Program a = Program {
+    progCode      :: UArray Int Int,
+    progConstants :: Array Int a
+  }
+
+opAccess, opGrab, opPush, opPrim, opPushVar :: Int
+opAccess  = 0
+opGrab    = 1
+opPush    = 2
+opPrim    = 3
+opPushVar = 4
+
+data Instr
+    = Access Int
+    | Grab
+    | Push Int          -- the number of the block to push
+    | PushVar Int
+    | Prim Int
+
+-- While compiling: how many blocks have been numbered, the blocks still to
+-- compile, and the constants so far, last first.
+data Builder a = Builder !Int [(Int, Exp a)] !Int [a]
+
+-- straight compiles a term up to its ACCESS or PRIM, leaving its arguments
+-- other than variables to be compiled as blocks of their own.
+straight :: Exp a -> State (Builder a) [Instr]
+straight (EVar z)   = return [Access z]
+straight (ELam b)   = (Grab :) <$> straight b
+straight (EApp t (EVar z)) = (PushVar z :) <$> straight t
+straight (EApp t u) = do
+    Builder n todo k cs <- get
+    put (Builder (n+1) ((n, u) : todo) k cs)
+    (Push n :) <$> straight t
+straight (EPrim p)  = do
+    Builder n todo k cs <- get
+    put (Builder n todo (k+1) (p : cs))
+    return [Prim k]
+
+compile :: Exp a -> Program a
+compile e = Program (UArray.listArray (0, length code - 1) code)
+                    (listArray (0, k - 1) (reverse cs))
+    where
+    (blocks, Builder _ _ k cs) = runState blocksFrom (Builder 1 [(0, e)] 0 [])
+    blocksFrom = do
+        Builder n todo k' cs' <- get
+        case todo of
+            [] -> return []
+            (i, t) : rest -> do
+                put (Builder n rest k' cs')
+                is <- straight t
+                ((i, is) :) <$> blocksFrom
+    size (Access _)  = 2
+    size Grab        = 1
+    size (Push _)    = 2
+    size (PushVar _) = 2
+    size (Prim _)    = 2
+    starts = IntMap.fromList (zip (map fst blocks) (scanl (+) 0 [ sum (map size is) | (_, is) <- blocks ]))
+    code = concatMap (concatMap encode . snd) blocks
+    encode (Access z)  = [opAccess, z]
+    encode Grab        = [opGrab]
+    encode (Push i)    = [opPush, starts IntMap.! i]
+    encode (PushVar z) = [opPushVar, z]
+    encode (Prim c)    = [opPrim, c]
+
+-- The code is in machine words, so the header says how big they are and in
+-- what order their bytes go.
+magic :: String
+magic = unwords [ "vatican-bytecode 2", show (8 * sizeOf (0 :: Int)) ++ "-bit", show targetByteOrder ]
+
+-- save writes a header line with the code size and the constants, then the
+-- code as raw machine words.
+save :: (Show a) => FilePath -> Program a -> IO ()
+save file p = withBinaryFile file WriteMode $ \h -> do
+    let code = progCode p
+        n = UArray.rangeSize (UArray.bounds code)
+    hPutStrLn h magic
+    hPutStrLn h (show (n, elems (progConstants p)))
+    arr <- newListArray (0, n - 1) (UArray.elems code) :: IO (StorableArray Int Int)
+    withStorableArray arr $ \ptr -> hPutBuf h ptr (n * sizeOf (0 :: Int))
+
+load :: (Read a) => FilePath -> IO (Program a)
+load file = withBinaryFile file ReadMode $ \h -> do
+    header <- hGetLine h
+    when (header /= magic) $ fail $ file ++ ": not a bytecode file for this machine (" ++ header ++ ")"
+    (n, cs) <- hGetLine h >>= \l -> case reads l of
+        [(sizes, "")] | fst sizes > 0 -> return sizes
+        _                             -> fail (file ++ ": bad header")
+    arr <- newArray_ (0, n - 1) :: IO (StorableArray Int Int)
+    let bytes = n * sizeOf (0 :: Int)
+    got <- withStorableArray arr $ \ptr -> hGetBuf h ptr bytes
+    when (got /= bytes) $ fail (file ++ ": truncated")
+    code <- freeze arr
+    maybe (return ()) (\err -> fail (file ++ ": " ++ err)) (check (length cs) code)
+    return (Program code (listArray (0, length cs - 1) cs))
+
+-- check says what is wrong with code read from a file, if anything.  Every
+-- instruction must be whole, with a known opcode and its operand in range,
+-- every PUSH must go to the start of an instruction, and the last must be an
+-- ACCESS or a PRIM, so that running the code never leaves the array.
+check :: Int -> UArray Int Int -> Maybe String
+check constants code = walk 0 IntSet.empty [] opGrab
+    where
+    n = UArray.rangeSize (UArray.bounds code)
+    walk pc starts targets final
+        | pc == n = if final /= opAccess && final /= opPrim then Just "code runs off its end"
+                    else case filter (`IntSet.notMember` starts) targets of
+                        l : _ -> Just ("PUSH " ++ show l ++ " is not to an instruction")
+                        []    -> Nothing
+        | op == opGrab = walk (pc + 1) starts' targets op
+        | op `notElem` [opAccess, opPush, opPushVar, opPrim] = Just ("bad opcode " ++ show op ++ " at " ++ show pc)
+        | pc + 1 == n = Just "last instruction truncated"
+        | op == opPrim && (arg < 0 || arg >= constants) = Just ("PRIM " ++ show arg ++ " out of range at " ++ show pc)
+        | op /= opPrim && arg < 0 = Just ("negative operand at " ++ show pc)
+        | op == opPush = walk (pc + 2) starts' (arg : targets) op
+        | otherwise = walk (pc + 2) starts' targets op
+        where
+        op = code UArray.! pc
+        arg = code UArray.! (pc + 1)
+        starts' = IntSet.insert pc starts
+
+data Env
+    = Nil
+    | Bind !Int !Env
+
+-- Heap cells.
+tagThunk, tagLambda, tagPrim, tagBlackHole :: Int
+tagThunk     = 0
+tagLambda    = 1        -- code starting with a GRAB
+tagPrim      = 2
+tagBlackHole = 3
+
+-- Stack frames.
+frameArg, frameUpdate, framePrimApply :: Int
+frameArg       = 0
+frameUpdate    = 1
+framePrimApply = 2
+
+data Machine a = Machine {
+    machineCode      :: UArray Int Int,
+    machineConstants :: Array Int a,
+    machineSize      :: IORef Int,
+    machineTag       :: Column.UColumn Int,
+    machinePc        :: Column.UColumn Int,
+    machineEnv       :: Column.BColumn Env,
+    machineValue     :: Column.BColumn a,
+    machineStack     :: Column.UColumn Int,
+    machineSp        :: IORef Int,
+    machineSteps     :: Stats.Counter,
+    machineUpdates   :: Stats.Counter,
+    machineFree      :: IORef [Int],        -- dead cells, to reuse
+    machineLimit     :: IORef Int,          -- the size that sets off a collection
+    machineGCs       :: Stats.Counter
+  }
+
+newMachine :: Program a -> IO (Machine a)
+newMachine p = Machine (progCode p) (progConstants p)
+    <$> newIORef 0 <*> Column.new 1024 <*> Column.new 1024 <*> Column.new 1024 <*> Column.new 1024
+    <*> Column.new 1024 <*> newIORef 0 <*> Stats.newCounter <*> Stats.newCounter
+    <*> newIORef [] <*> newIORef 1024 <*> Stats.newCounter
+
+machineStats :: Machine a -> IO Stats.Stats
+machineStats m = do
+    cells <- readIORef (machineSize m)
+    counts <- Stats.readCounters [ ("vm.steps", machineSteps m)
+                                 , ("vm.updates", machineUpdates m)
+                                 , ("vm.collections", machineGCs m) ]
+    return $ ("vm.code-size", UArray.rangeSize (UArray.bounds (machineCode m))) : ("vm.cells", cells) : counts
+
+-- alloc makes a cell, reusing a dead one if there is one.  When the heap has
+-- reached its limit it collects first, the cell's env and extra being live
+-- besides what is on the stack, and it doubles the limit if less than half
+-- of the heap was dead.
+alloc :: Machine a -> [Int] -> Int -> Int -> Env -> a -> IO Int
+alloc m extra tag pc env x = do
+    free <- readIORef (machineFree m)
+    free' <- if not (null free) then return free else do
+        size <- readIORef (machineSize m)
+        limit <- readIORef (machineLimit m)
+        if size < limit then return [] else do
+        dead <- collect m extra env
+        when (2 * length dead < size) $ writeIORef (machineLimit m) $! 2 * limit
+        return dead
+    addr <- case free' of
+        a : rest -> writeIORef (machineFree m) rest >> return a
+        [] -> do
+            a <- readIORef (machineSize m)
+            writeIORef (machineSize m) $! a + 1
+            Column.grow (machineTag m) a
+            Column.grow (machinePc m) a
+            Column.grow (machineEnv m) a
+            Column.grow (machineValue m) a
+            return a
+    setCell m addr tag pc env x
+    return addr
+
+-- collect marks the cells reachable from the stack, env and extra, and gives
+-- the others, emptied so that they keep nothing alive.  A dead cell looks
+-- like a black hole, so that entering one by mistake fails.
+collect :: Machine a -> [Int] -> Env -> IO [Int]
+collect m extra env = do
+    Stats.tick (machineGCs m)
+    size <- readIORef (machineSize m)
+    sp <- readIORef (machineSp m)
+    marks <- newArray (0, size - 1) False :: IO (IOUArray Int Bool)
+    frames <- mapM (Column.read (machineStack m)) [1, 3 .. sp - 1]
+    let mark [] = return ()
+        mark (addr : rest) = do
+            seen <- readArray marks addr
+            if seen then mark rest else do
+            writeArray marks addr True
+            cellEnv <- Column.read (machineEnv m) addr
+            mark (addresses cellEnv ++ rest)
+    mark (extra ++ addresses env ++ frames)
+    dead <- filterM (fmap not . readArray marks) [0 .. size - 1]
+    forM_ dead $ \addr -> setCell m addr tagBlackHole 0 emptyEnv noValue
+    return dead
+
+setCell :: Machine a -> Int -> Int -> Int -> Env -> a -> IO ()
+setCell m addr tag pc env x = do
+    Column.write (machineTag m) addr tag
+    Column.write (machinePc m) addr pc
+    Column.write (machineEnv m) addr env
+    Column.write (machineValue m) addr x
+
+noValue :: a
+noValue = error "Bytecode: not a primitive"
+
+push :: Machine a -> Int -> Int -> IO ()
+push m frame x = do
+    sp <- readIORef (machineSp m)
+    Column.grow (machineStack m) (sp + 1)
+    Column.write (machineStack m) sp frame
+    Column.write (machineStack m) (sp + 1) x
+    writeIORef (machineSp m) $! sp + 2
+
+-- pop gives the frame on top of the stack, or Nothing if it is empty.
+pop :: Machine a -> IO (Maybe (Int, Int))
+pop m = do
+    sp <- readIORef (machineSp m)
+    if sp == 0 then return Nothing else do
+    writeIORef (machineSp m) $! sp - 2
+    frame <- Column.read (machineStack m) (sp - 2)
+    x <- Column.read (machineStack m) (sp - 1)
+    return (Just (frame, x))
+
+emptyEnv :: Env
+emptyEnv = Nil
+
+extend :: Int -> Env -> Env
+extend = Bind
+
+lookupEnv :: Env -> Int -> Int
+lookupEnv (Bind addr _) 0 = addr
+lookupEnv (Bind _ env)  i = lookupEnv env (i - 1)
+lookupEnv Nil           _ = error "Bytecode: unbound variable"
+
+addresses :: Env -> [Int]
+addresses Nil             = []
+addresses (Bind addr env) = addr : addresses env
+
+-- exec runs the code at pc in env.
+exec :: (HOAS.Primitive a) => Machine a -> Int -> Env -> IO a
+exec m pc env = do
+    Stats.tick (machineSteps m)
+    let op = code `unsafeAt` pc
+        arg = code `unsafeAt` (pc + 1)
+    if op == opAccess then enter m (lookupEnv env arg)
+    else if op == opPush then do
+        addr <- alloc m [] tagThunk arg env noValue
+        push m frameArg addr
+        exec m (pc + 2) env
+    else if op == opPushVar then do
+        push m frameArg (lookupEnv env arg)
+        exec m (pc + 2) env
+    else if op == opGrab then grab m pc env
+    else returnPrim m (machineConstants m ! arg)
+    where
+    code = machineCode m
+
+-- enter runs the closure in a heap cell, pushing an update frame for it if
+-- it is still a thunk.
+enter :: (HOAS.Primitive a) => Machine a -> Int -> IO a
+enter m addr = do
+    tag <- Column.read (machineTag m) addr
+    if tag == tagPrim then returnPrim m =<< Column.read (machineValue m) addr
+    else if tag == tagBlackHole then fail "Bytecode: <<loop>>"
+    else do
+    pc <- Column.read (machinePc m) addr
+    env <- Column.read (machineEnv m) addr
+    when (tag == tagThunk) $ do
+        Column.write (machineTag m) addr tagBlackHole
+        push m frameUpdate addr
+    exec m pc env
+
+-- grab gives the lambda at pc its argument, updating cells on the way.
+grab :: (HOAS.Primitive a) => Machine a -> Int -> Env -> IO a
+grab m pc env = do
+    top <- pop m
+    case top of
+        Nothing -> fail "Not a prim!"
+        Just (frame, addr)
+            | frame == frameArg -> exec m (pc + 1) (extend addr env)
+            | frame == frameUpdate -> do
+                Stats.tick (machineUpdates m)
+                setCell m addr tagLambda pc env noValue
+                grab m pc env
+            | otherwise -> fail "Can't apply primitive to lambda"
+
+-- returnPrim returns a primitive to the frame on top of the stack.
+returnPrim :: (HOAS.Primitive a) => Machine a -> a -> IO a
+returnPrim m x = do
+    top <- pop m
+    case top of
+        Nothing -> return x
+        Just (frame, addr)
+            | frame == frameUpdate -> do
+                Stats.tick (machineUpdates m)
+                setCell m addr tagPrim 0 emptyEnv x
+                returnPrim m x
+            | frame == frameArg -> do
+                cell <- alloc m [addr] tagPrim 0 emptyEnv x
+                push m framePrimApply cell
+                enter m addr
+            | otherwise -> do
+                f <- Column.read (machineValue m) addr
+                returnPrim m (f `HOAS.apply` x)
+
+evalStats :: (HOAS.Primitive a) => Program a -> IO (a, Stats.Stats)
+evalStats p = do
+    m <- newMachine p
+    x <- exec m 0 emptyEnv
+    stats <- machineStats m
+    return (x, stats)
+
+eval :: (HOAS.Primitive a) => Program a -> IO a
+eval = fmap fst . evalStats
@@ -0,0 +1,67 @@
+-- Closure compilation.  A term is compiled once into a Haskell function from
+-- an environment to a value, so that running it never looks at the syntax
+-- again.  Environments are flat: a lambda copies the variables it uses into
+-- an array when it is made, the argument going in slot 0, and every variable
+-- is compiled to a read from the slot it was given at compile time.
+-- Arguments are Haskell thunks, so like "ref" this is call-by-need.
+--
+-- It is specialized to Value: successor is applied by pattern matching, not
+-- through the Primitive dictionary.
+
+module Closure (eval) where
+
+import DeBruijn (Exp(..), freeVars)
+import HOAS (Primitive(..))
+import Value
+import Data.Array
+import Data.Array.Base (unsafeAt, unsafeRead, unsafeThaw)
+import Data.Array.ST (STArray)
+import Control.Monad.ST (ST, runST)
+import Data.List (elemIndex)
+import qualified Data.IntSet as IntSet
+
+data Val
+    = Fun (Val -> Val)
+    | Prim !Value
+
+type Env = Array Int Val
+
+type Code = Env -> Val
+
+vapply :: Val -> Val -> Val
+vapply (Fun f)      x                = f x
+vapply (Prim VSucc) (Prim (VInt n))  = Prim (VInt (n+1))
+vapply (Prim a)     (Prim b)         = Prim (a `apply` b)
+vapply (Prim _)     (Fun _)          = error "Type error!"
+
+-- compile slots e compiles e, slots giving the slot of each variable by
+-- deBruijn index.
+compile :: [Int] -> Exp Value -> Code
+compile slots (EVar z) = let s = slots !! z in \env -> env `unsafeAt` s
+compile slots (EApp t u) = \env -> ct env `vapply` cu env
+    where
+    ct = compile slots t
+    cu = compile slots u
+compile _ (EPrim p) = const (Prim p)
+compile slots (ELam body) = \env ->
+    let values = capture env captured
+    in values `seq` Fun (\x -> cbody (listArray (0, n) (x : values)))
+    where
+    fvs = IntSet.toList (freeVars (ELam body))
+    n = length fvs
+    captured = map (slots !!) fvs
+    inner = 0 : [ maybe unused (+1) (elemIndex z fvs) | z <- [0..] ]
+    unused = error "Closure: variable not captured"
+    cbody = compile inner body
+
+-- capture reads the given slots of env now, so that a closure keeps only
+-- what is in them alive, not all of env; what is in them is not forced.
+capture :: Env -> [Int] -> [Val]
+capture env slots = runST $ do
+    arr <- unsafeThaw env :: ST s (STArray s Int Val)
+    mapM (unsafeRead arr) slots
+
+eval :: Exp Value -> Value
+eval e = case compile [] e (listArray (0, -1) []) of
+    Prim a -> a
+    Fun _  -> error "Not a prim!"
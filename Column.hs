@@ -0,0 +1,40 @@
+{-# LANGUAGE FlexibleContexts #-}
+
+-- Growable mutable arrays, used as the columns of the array-backed node
+-- stores.  Indices are not bounds checked: use grow to make an index valid
+-- before touching it.
+
+module Column
+    ( Column, UColumn, BColumn, new, read, write, grow )
+where
+
+import Prelude hiding (read)
+import Data.IORef
+import Data.Array.Base (MArray(..))
+import Data.Array.IO (IOArray, IOUArray)
+import Control.Monad (when, forM_)
+
+newtype Column arr e = Column (IORef (arr Int e))
+
+type UColumn = Column IOUArray
+type BColumn = Column IOArray
+
+new :: (MArray arr e IO) => Int -> IO (Column arr e)
+new n = fmap Column . newIORef =<< newArray_ (0, max 1 n - 1)
+
+read :: (MArray arr e IO) => Column arr e -> Int -> IO e
+read (Column ref) i = readIORef ref >>= \arr -> unsafeRead arr i
+
+write :: (MArray arr e IO) => Column arr e -> Int -> e -> IO ()
+write (Column ref) i x = readIORef ref >>= \arr -> unsafeWrite arr i x
+
+-- grow makes index i valid, at least doubling the capacity when it has to
+-- reallocate.
+grow :: (MArray arr e IO) => Column arr e -> Int -> IO ()
+grow (Column ref) i = do
+    arr <- readIORef ref
+    n <- getNumElements arr
+    when (i >= n) $ do
+        arr' <- newArray_ (0, max (i+1) (2*n) - 1)
+        forM_ [0 .. n-1] $ \j -> unsafeWrite arr' j =<< unsafeRead arr j
+        writeIORef ref arr'
@@ -1,12 +1,13 @@
 -- A compiler for terms in HOAS to deBruijn-encoded terms.
 
-module DeBruijn (Exp(..), DeBruijn, getDeBruijn, toHOAS) where
+module DeBruijn (Exp(..), DeBruijn, getDeBruijn, toHOAS, size, freeVars, pretty) where
 
 import HOAS
 import Control.Monad.Trans.Class
 import Control.Monad.Trans.Reader
 import Control.Monad.Trans.State
 import qualified Data.Map as Map
+import qualified Data.IntSet as IntSet
 import Control.Applicative
 
 data Exp a
@@ -26,6 +27,32 @@ parens True x = "(" ++ x ++ ")"
 instance (Show a) => Show (Exp a) where
     show = showExp False False
 
+-- pretty prints a term in the concrete syntax Parser reads, naming each
+-- variable after the depth of its binder.  That syntax has no primitives, so
+-- they come out in brackets as in show.
+pretty :: (Show a) => Exp a -> String
+pretty e = prettyS 0 False False e ""
+
+prettyS :: (Show a) => Int -> Bool -> Bool -> Exp a -> ShowS
+prettyS n lp ap (ELam e) = showParen lp $
+    showString "\\v" . shows n . showString " -> " . prettyS (n+1) False False e
+prettyS n lp ap (EApp t u) = showParen ap $
+    prettyS n True False t . showChar ' ' . prettyS n True True u
+prettyS n lp ap (EVar z) = showChar 'v' . shows (n - 1 - z)
+prettyS n lp ap (EPrim a) = showChar '[' . shows a . showChar ']'
+
+size :: Exp a -> Int
+size (ELam e)   = 1 + size e
+size (EApp t u) = 1 + size t + size u
+size _          = 1
+
+-- The free variables of a term, by deBruijn index.
+freeVars :: Exp a -> IntSet.IntSet
+freeVars (ELam body) = IntSet.map (subtract 1) (IntSet.delete 0 (freeVars body))
+freeVars (EApp t u)  = freeVars t `IntSet.union` freeVars u
+freeVars (EVar z)    = IntSet.singleton z
+freeVars (EPrim _)   = IntSet.empty
+
 newtype DeBruijn a = DeBruijn { rundB :: ReaderT (Map.Map Int Int) (State Int) (Exp a) }
 
 instance Term (DeBruijn a) where
@@ -0,0 +1,80 @@
+-- Sets of variable depths, as carried by Thyer's nodes for their free
+-- variables.  Depths below 64 are kept as a bitset in one word; deeper terms
+-- fall back to an IntSet.
+
+module DepthSet
+    ( DepthSet, empty, singleton, null, member, union, delete, allBelow, substitute )
+where
+
+import Prelude hiding (null)
+import Data.Bits
+import Data.Word (Word64)
+import qualified Data.IntSet as IntSet
+
+-- Small exactly when every element is below wordBits.
+data DepthSet
+    = Small !Word64
+    | Large !IntSet.IntSet
+
+wordBits :: Int
+wordBits = 64
+
+-- lowMask d has the bits for the depths below d set.
+lowMask :: Int -> Word64
+lowMask d | d >= wordBits = maxBound
+          | d <= 0        = 0
+          | otherwise     = bit d - 1
+
+toIntSet :: DepthSet -> IntSet.IntSet
+toIntSet (Small w) = IntSet.fromList [ d | d <- [0 .. wordBits-1], testBit w d ]
+toIntSet (Large s) = s
+
+fromIntSet :: IntSet.IntSet -> DepthSet
+fromIntSet s
+    | IntSet.null s || IntSet.findMax s < wordBits = Small (foldl setBit 0 (IntSet.toList s))
+    | otherwise                                    = Large s
+
+empty :: DepthSet
+empty = Small 0
+
+singleton :: Int -> DepthSet
+singleton d | d < wordBits = Small (bit d)
+            | otherwise    = Large (IntSet.singleton d)
+
+null :: DepthSet -> Bool
+null (Small w) = w == 0
+null (Large _) = False
+
+member :: Int -> DepthSet -> Bool
+member d (Small w) = d < wordBits && testBit w d
+member d (Large s) = IntSet.member d s
+
+union :: DepthSet -> DepthSet -> DepthSet
+union (Small w) (Small w') = Small (w .|. w')
+union s s' = Large (IntSet.union (toIntSet s) (toIntSet s'))
+
+delete :: Int -> DepthSet -> DepthSet
+delete d (Small w) | d < wordBits = Small (clearBit w d)
+                   | otherwise    = Small w
+delete d (Large s) = fromIntSet (IntSet.delete d s)
+
+-- allBelow d s holds when every depth in s is less than d.
+allBelow :: Int -> DepthSet -> Bool
+allBelow d (Small w) = w .&. complement (lowMask d) == 0
+allBelow d (Large s) = IntSet.findMax s < d
+
+-- substitute bind shift body arg gives the free depths of body once the
+-- variable at depth bind is replaced by a term whose free depths are arg, and
+-- the depths above bind are moved by shift; cf. Thyer.subst.
+substitute :: Int -> Int -> DepthSet -> DepthSet -> DepthSet
+substitute bind shift body arg = moved `union` (if member bind body then arg else empty)
+    where
+    moved = case body of
+        Small w | shift <= 0 ->
+                    Small ((w .&. low) .|. (w .&. high) `shiftR` negate shift)
+                | shift < wordBits && (w .&. high) `shiftR` (wordBits - shift) == 0 ->
+                    Small ((w .&. low) .|. (w .&. high) `shiftL` shift)
+        _ -> fromIntSet . IntSet.fromList $
+                [ if d > bind then d + shift else d | d <- IntSet.toList (toIntSet body), d /= bind ]
+    low  = lowMask bind
+    high = complement (lowMask (bind + 1))
@@ -0,0 +1,112 @@
+-- Full laziness as a program transformation: the maximal free expressions of
+-- each lambda body, the largest applications that mention none of the
+-- variables bound inside the lambda, are floated out of it as lets, so that
+-- they are evaluated once rather than once per call.  Lambdas are done
+-- innermost first, so an expression floats out of as many lambdas as it can.
+--
+-- A let is the redex (\x. body) defn, which every engine shares as it shares
+-- any argument.
+
+module Float (float) where
+
+import DeBruijn (Exp(..))
+import qualified Stats
+import qualified Data.IntSet as IntSet
+import Control.Applicative
+import Control.Monad.Trans.State.Strict
+
+-- Terms as floating sees them: lambdas and applications carry their free
+-- variables, worked out once from their parts by lam and app, so that telling
+-- whether an expression is free does not walk it again for every lambda
+-- around it.
+data Term a
+    = Var Int
+    | Prim a
+    | Lam IntSet.IntSet (Term a)
+    | App IntSet.IntSet (Term a) (Term a)
+
+freeIn :: Term a -> IntSet.IntSet
+freeIn (Var z)        = IntSet.singleton z
+freeIn (Prim _)       = IntSet.empty
+freeIn (Lam fvs _)    = fvs
+freeIn (App fvs _ _)  = fvs
+
+lam :: Term a -> Term a
+lam body = Lam (IntSet.map (subtract 1) (IntSet.delete 0 (freeIn body))) body
+
+app :: Term a -> Term a -> Term a
+app t u = App (freeIn t `IntSet.union` freeIn u) t u
+
+annotate :: Exp a -> Term a
+annotate (EVar z)    = Var z
+annotate (EPrim p)   = Prim p
+annotate (ELam body) = lam (annotate body)
+annotate (EApp t u)  = app (annotate t) (annotate u)
+
+strip :: Term a -> Exp a
+strip (Var z)      = EVar z
+strip (Prim p)     = EPrim p
+strip (Lam _ body) = ELam (strip body)
+strip (App _ t u)  = EApp (strip t) (strip u)
+
+size :: Term a -> Int
+size (Lam _ body) = 1 + size body
+size (App _ t u)  = 1 + size t + size u
+size _            = 1
+
+-- shift by e adds by to the free variables of e, leaving alone the parts
+-- that have none to change.
+shift :: Int -> Term a -> Term a
+shift by = go 0
+    where
+    go d e | maybe True ((< d) . fst) (IntSet.maxView (freeIn e)) = e
+    go d (Lam _ body)  = lam (go (d+1) body)
+    go d (App _ t u)   = app (go d t) (go d u)
+    go _ (Var z)       = Var (z + by)
+    go _ e             = e
+
+-- float gives the transformed term, and how many lets it made and how big
+-- the expressions floated were.
+float :: Exp a -> (Exp a, Stats.Stats)
+float e = (strip e', [ ("float.lets", lets), ("float.size", floated) ])
+    where
+    (e', (lets, floated)) = runState (floatIn (annotate e)) (0, 0)
+
+floatIn :: Term a -> State (Int, Int) (Term a)
+floatIn (Lam _ body) = do
+    body' <- floatIn body
+    let k = count 0 body'
+        (body'', (_, defns)) = runState (extract k 0 body') (0, [])
+    (lets, floated) <- get
+    put (lets + k, floated + sum (map size defns))
+    return (foldl (\inner defn -> app (lam inner) defn) (lam body'') defns)
+floatIn (App _ t u) = app <$> floatIn t <*> floatIn u
+floatIn e = return e
+
+-- free d e holds when e, under d binders in a lambda body, is an application
+-- that mentions none of the variables bound in the lambda.
+free :: Int -> Term a -> Bool
+free d (App fvs _ _) = maybe True ((> d) . fst) (IntSet.minView fvs)
+free _ _             = False
+
+-- count d e is the number of maximal free expressions in e.
+count :: Int -> Term a -> Int
+count d e | free d e  = 1
+count d (Lam _ body)  = count (d+1) body
+count d (App _ t u)   = count d t + count d u
+count _ _             = 0
+
+-- extract k d e replaces the maximal free expressions of e, under d binders
+-- in the body of a lambda, by the variables of the k lets to go around the
+-- lambda, outermost first.  The state is the number found so far, and the
+-- expressions themselves, innermost first, each shifted to where its let is.
+extract :: Int -> Int -> Term a -> State (Int, [Term a]) (Term a)
+extract k d e | free d e = do
+    (i, defns) <- get
+    put (i + 1, shift (i - d - 1) e : defns)
+    return (Var (d + k - i))
+extract k d (Lam _ body) = lam <$> extract k (d+1) body
+extract k d (App _ t u)  = app <$> extract k d t <*> extract k d u
+extract k d (Var z)
+    | z > d              = return (Var (z + k))
+extract _ _ e            = return e
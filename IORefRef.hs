@@ -1,20 +1,33 @@
+{-# LANGUAGE MultiParamTypeClasses #-}
+
+-- The simplest Ref.Store: a reference is an IORef.  link copies what the new
+-- reference holds into the old one, so the two stop sharing afterwards:
+-- reducing one of them does not reduce the other.  It never follows chains.
+
 module IORefRef
-    ( Ref, new, read, write, link )
+    ( Store, Ref, newStore )
 where
 
 import Prelude hiding (read)
+import qualified Ref
+import qualified Stats
 import Data.IORef
 
-newtype Ref a = Ref (IORef a)
+newtype Store a = Store Stats.Counter   -- links
 
-new :: a -> IO (Ref a)
-new = fmap Ref . newIORef
-
-read :: Ref a -> IO a
-read (Ref ioref) = readIORef ioref
+newtype Ref a = Ref (IORef a)
 
-write :: Ref a -> a -> IO ()
-write (Ref ioref) = writeIORef ioref
+newStore :: IO (Store a)
+newStore = fmap Store Stats.newCounter
 
-link :: Ref a -> Ref a -> IO ()
-link old new = write old =<< read new
+instance Ref.Store Store Ref where
+    new _ = fmap Ref . newIORef
+    read _ (Ref ioref) = readIORef ioref
+    write _ (Ref ioref) = writeIORef ioref
+    link store@(Store links) old new = do
+        Stats.tick links
+        Ref.write store old =<< Ref.read store new
+    resolve _ _ = return Nothing
+    stats (Store links) = do
+        n <- Stats.readCounter links
+        return [ ("ref.links", n), ("ref.chain-steps", 0), ("ref.max-chain", 0) ]
@@ -0,0 +1,171 @@
+-- A lazy Krivine machine, after Sestoft's
+-- Deriving a Lazy Abstract Machine (1997).
+--
+-- A DeBruijn.Exp is first compiled so that variables are slots of flat
+-- environments: an environment is an unboxed array of heap addresses, and a
+-- closure, whether an argument or a lambda, copies into a fresh one just the
+-- slots of the variables it uses, as in Closure.hs, a lambda's argument going
+-- in slot 0.  Arguments are allocated in a mutable heap of closures, and the
+-- first time one is entered an update frame is pushed, so that the cell is
+-- overwritten with its weak head normal form and never evaluated again.  An
+-- argument that is a variable is already in the heap, and is passed as it is.
+
+module Krivine (eval, evalStats) where
+
+import DeBruijn (Exp(..))
+import qualified HOAS
+import qualified Column
+import qualified Stats
+import Data.Array.Unboxed
+import Data.Array.Base (unsafeAt)
+import qualified Data.IntMap as IntMap
+import qualified Data.IntSet as IntSet
+import Data.IORef
+import Control.Applicative
+
+type Addr = Int
+
+type Env = UArray Int Addr
+
+-- The slots of the environment a closure is made in that it copies, in the
+-- order of its own.
+type Slots = UArray Int Int
+
+data Code a
+    = CVar !Int
+    | CApp (Code a) !Slots (Code a)     -- function; argument's slots and code
+    | CAppVar (Code a) !Int             -- function; argument's slot
+    | CLam !Slots (Code a)
+    | CPrim a
+
+-- compile slot e compiles e, slot giving the slot of each variable by
+-- deBruijn index, and gives the free variables of e too.  Those of a closure
+-- decide the slots inside it: see closure.
+compile :: (Int -> Int) -> Exp a -> (Code a, IntSet.IntSet)
+compile slot (EVar z) = (CVar (slot z), IntSet.singleton z)
+compile _    (EPrim p) = (CPrim p, IntSet.empty)
+compile slot (EApp t (EVar z)) = (CAppVar ct (slot z), IntSet.insert z ft)
+    where
+    (ct, ft) = compile slot t
+compile slot (EApp t u) = (CApp ct slots cu, ft `IntSet.union` fu)
+    where
+    (ct, ft) = compile slot t
+    (slots, cu, fu) = closure slot 0 u
+compile slot (ELam body) = (CLam slots cbody, fvs)
+    where
+    (slots, cbody, fvs) = closure slot 1 body
+
+-- closure slot k e compiles e as the code of a closure with k variables of
+-- its own, 0 for an argument and 1 for a lambda's body, giving the slots it
+-- copies and its free variables.  The slots inside are worked out from the
+-- free variables of e, which compile gives without looking at them.
+closure :: (Int -> Int) -> Int -> Exp a -> (Slots, Code a, IntSet.IntSet)
+closure slot k e = (listArray (0, length vars - 1) (map slot vars), code, fvs)
+    where
+    (code, inner) = compile local e
+    fvs = IntSet.map (subtract k) (snd (IntSet.split (k - 1) inner))
+    vars = IntSet.toList fvs
+    positions = IntMap.fromList (zip vars [k ..])
+    local z | z < k     = z
+            | otherwise = positions IntMap.! (z - k)
+
+data Cell a
+    = Thunk (Code a) !Env
+    | Value (Code a) !Env       -- a lambda or a primitive
+    | BlackHole                 -- being evaluated
+
+data Frame a
+    = Arg !Addr                 -- apply the value to this argument
+    | Update !Addr              -- overwrite this cell with the value
+    | PrimApply a               -- apply this primitive to the value
+
+data Machine a = Machine {
+    machineHeap    :: Column.BColumn (Cell a),
+    machineSize    :: IORef Int,
+    machineSteps   :: Stats.Counter,
+    machineUpdates :: Stats.Counter
+  }
+
+newMachine :: IO (Machine a)
+newMachine = Machine <$> Column.new 1024 <*> newIORef 0 <*> Stats.newCounter <*> Stats.newCounter
+
+machineStats :: Machine a -> IO Stats.Stats
+machineStats m = do
+    cells <- readIORef (machineSize m)
+    counts <- Stats.readCounters [ ("krivine.steps", machineSteps m)
+                                 , ("krivine.updates", machineUpdates m) ]
+    return $ ("krivine.cells", cells) : counts
+
+alloc :: Machine a -> Cell a -> IO Addr
+alloc m cell = do
+    addr <- readIORef (machineSize m)
+    writeIORef (machineSize m) $! addr + 1
+    Column.grow (machineHeap m) addr
+    Column.write (machineHeap m) addr cell
+    return addr
+
+emptyEnv :: Env
+emptyEnv = listArray (0, -1) []
+
+capture :: Env -> Slots -> Env
+capture env = amap (unsafeAt env)
+
+-- extend gives a lambda's body its environment: the argument, then what the
+-- lambda captured.
+extend :: Addr -> Env -> Env
+extend addr env = listArray (0, n) (addr : elems env)
+    where
+    n = snd (bounds env) + 1
+
+-- run evaluates the closure (code, env) against the stack, until it is a
+-- primitive with nothing left to do.
+run :: (HOAS.Primitive a) => Machine a -> Code a -> Env -> [Frame a] -> IO a
+run m code env stack = do
+    Stats.tick (machineSteps m)
+    case code of
+        CApp t slots u -> do
+            addr <- alloc m (Thunk u (capture env slots))
+            run m t env (Arg addr : stack)
+        CAppVar t i -> run m t env (Arg (env `unsafeAt` i) : stack)
+        CVar i -> enter m (env `unsafeAt` i) stack
+        CLam slots _ -> value m code (capture env slots) stack
+        CPrim _ -> value m code emptyEnv stack
+
+-- enter evaluates the closure in a heap cell, pushing an update frame for it
+-- if it is still a thunk.
+enter :: (HOAS.Primitive a) => Machine a -> Addr -> [Frame a] -> IO a
+enter m addr stack = do
+    cell <- Column.read (machineHeap m) addr
+    case cell of
+        Thunk t e -> do
+            Column.write (machineHeap m) addr BlackHole
+            run m t e (Update addr : stack)
+        Value t e -> value m t e stack
+        BlackHole -> fail "Krivine: <<loop>>"
+
+-- value returns the value (code, env) to the frame on top of the stack.
+value :: (HOAS.Primitive a) => Machine a -> Code a -> Env -> [Frame a] -> IO a
+value m code env stack = case (code, stack) of
+    (_, Update addr : rest) -> do
+        Stats.tick (machineUpdates m)
+        Column.write (machineHeap m) addr (Value code env)
+        value m code env rest
+    (CLam _ body, Arg addr : rest) -> run m body (extend addr env) rest
+    (CLam _ _, PrimApply _ : _) -> fail "Can't apply primitive to lambda"
+    (CLam _ _, []) -> fail "Not a prim!"
+    (CPrim p, Arg addr : rest) -> enter m addr (PrimApply p : rest)
+    (CPrim p, PrimApply f : rest) -> value m (CPrim (f `HOAS.apply` p)) emptyEnv rest
+    (CPrim p, []) -> return p
+    _ -> fail "Krivine: not a value"
+
+evalStats :: (HOAS.Primitive a) => Exp a -> IO (a, Stats.Stats)
+evalStats t = do
+    m <- newMachine
+    x <- run m (fst (compile unbound t)) emptyEnv []
+    stats <- machineStats m
+    return (x, stats)
+    where
+    unbound z = error $ "Krivine: unbound variable " ++ show z
+
+eval :: (HOAS.Primitive a) => Exp a -> IO a
+eval = fmap fst . evalStats
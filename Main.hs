@@ -5,42 +5,162 @@ module Main where
 import HOAS
 import DeBruijn
 import qualified BUBS
+import qualified BUBSArena
 import qualified Reference
 import qualified Thyer
+import qualified ThyerArena
 import qualified Naive
+import qualified Krivine
+import qualified NbE
+import qualified Optimal
+import qualified Parallel
+import qualified Closure
+import qualified Bytecode
+import qualified Float
+import qualified Stats
+import Value
 import System.Environment (getArgs)
 import qualified Data.Char as Char
 import qualified Parser
 import Data.List (intercalate)
+import Data.Maybe (isJust)
 import Control.Applicative
+import Control.Arrow (first, second)
+import Control.Monad (when)
 
-data Value
-    = VSucc
-    | VInt !Integer
-    deriving Show
-
-instance Primitive Value where
-    apply VSucc (VInt x) = VInt (x+1)
-    apply x y = error $ "Type error when applying (" ++ show x ++ ") to (" ++ show y ++ ")"
-    
-interpreters :: [ (String, DeBruijn.Exp Value -> IO Value) ]
-interpreters = [ "bubs"  --> BUBS.eval . toHOAS
-               , "thyer" --> Thyer.eval . toHOAS
-               , "ref"   --> return . Reference.eval . toHOAS
-               , "naive" --> return . Naive.eval . toHOAS
+interpreters :: Flags -> [ (String, DeBruijn.Exp Value -> IO (Value, Stats.Stats)) ]
+interpreters flags = [ "bubs"  --> bubs BUBS.defaultConfig
+               , "bubs-nf" --> bubs BUBS.defaultConfig { BUBS.cfgNormalize = True }
+               , "bubs-memo" --> bubs BUBS.defaultConfig { BUBS.cfgMemo = True }
+               , "bubs-arena" --> BUBSArena.evalStats . toHOAS
+               , "thyer" --> thyer Thyer.defaultConfig
+               , "thyer-nomemo" --> thyer Thyer.defaultConfig { Thyer.cfgMemo = False }
+               , "thyer-indir" --> thyer Thyer.defaultConfig { Thyer.cfgBackend = Thyer.IndirBackend }
+               , "thyer-uf" --> thyer Thyer.defaultConfig { Thyer.cfgBackend = Thyer.UnionFindBackend }
+               , "thyer-arena" --> ThyerArena.evalStats Thyer.defaultConfig . toHOAS
+               , "ref"   --> noStats (return . Reference.eval . toHOAS)
+               , "nbe"   --> noStats (return . NbE.eval)
+               , "closure" --> noStats (return . Closure.eval)
+               , "vm"    --> vm
+               , "krivine" --> Krivine.evalStats
+               , "optimal" --> Optimal.evalStats
+               , "parallel" --> Parallel.evalStats Parallel.defaultConfig { Parallel.cfgCores = flagCores flags }
+               , "naive" --> noStats (return . Naive.eval . toHOAS)
+               , "naive-need" --> return . Naive.evalNeedStats . toHOAS
                ]
     where
     infix 0 -->
     (-->) = (,)
+    noStats f = fmap (,[]) . f
+    thyer cfg = Thyer.evalStats (thyerConfig flags cfg) . toHOAS
+    vm e = do
+        let program = Bytecode.compile e
+        maybe (return ()) (`Bytecode.save` program) (flagSaveBytecode flags)
+        Bytecode.evalStats program
+    bubs cfg = BUBS.evalStats cfg { BUBS.cfgTraceGraphs = flagTraceGraphs flags } . toHOAS
+
+thyerConfig :: Flags -> Thyer.Config -> Thyer.Config
+thyerConfig flags cfg = cfg { Thyer.cfgCompactEvery = flagCompact flags }
+
+data Flags = Flags {
+    flagStats        :: Bool,
+    flagResidualize  :: Maybe FilePath,
+    flagNormalize    :: Maybe FilePath,
+    flagFloat        :: Bool,
+    flagFuel         :: Int,
+    flagCompact      :: Maybe Int,
+    flagTraceGraphs  :: Maybe Int,
+    flagCores        :: [Int],
+    flagSaveBytecode :: Maybe FilePath,
+    flagLoadBytecode :: Maybe FilePath
+  }
+
+defaultFlags :: Flags
+defaultFlags = Flags { flagStats = False, flagResidualize = Nothing, flagNormalize = Nothing, flagFloat = False, flagFuel = 100000, flagCompact = Nothing, flagTraceGraphs = Nothing, flagCores = [], flagSaveBytecode = Nothing, flagLoadBytecode = Nothing }
+
+parseFlags :: [String] -> (Flags, [String])
+parseFlags ("--stats" : args) = first (\f -> f { flagStats = True }) (parseFlags args)
+parseFlags ("--float" : args) = first (\f -> f { flagFloat = True }) (parseFlags args)
+parseFlags ("--residualize" : file : args) = first (\f -> f { flagResidualize = Just file }) (parseFlags args)
+parseFlags ("--normalize" : file : args) = first (\f -> f { flagNormalize = Just file }) (parseFlags args)
+parseFlags ("--save-bytecode" : file : args) = first (\f -> f { flagSaveBytecode = Just file }) (parseFlags args)
+parseFlags ("--load-bytecode" : file : args) = first (\f -> f { flagLoadBytecode = Just file }) (parseFlags args)
+parseFlags ("--fuel" : n : args)
+    | Just fuel <- readCount n = first (\f -> f { flagFuel = fuel }) (parseFlags args)
+parseFlags ("--compact" : n : args)
+    | Just every <- readCount n = first (\f -> f { flagCompact = Just every }) (parseFlags args)
+parseFlags ("--trace-graphs" : n : args)
+    | Just every <- readCount n = first (\f -> f { flagTraceGraphs = Just every }) (parseFlags args)
+parseFlags ("--cores" : ns : args)
+    | Just cores <- mapM readCount (splitOn ',' ns) = first (\f -> f { flagCores = cores }) (parseFlags args)
+    where
+    splitOn c xs = case break (== c) xs of
+        (x, [])   -> [x]
+        (x, _:ys) -> x : splitOn c ys
+parseFlags (arg : args)       = second (arg:) (parseFlags args)
+parseFlags []                 = (defaultFlags, [])
+
+-- readCount reads a positive number: of cores, of steps of fuel, or of steps
+-- between two compactions or snapshots.
+readCount :: String -> Maybe Int
+readCount n | [(c, "")] <- reads n, c > 0 = Just c
+            | otherwise                   = Nothing
 
 main :: IO ()
 main = do
-    args <- getArgs
+    (flags, args) <- parseFlags <$> getArgs
+    case (flagLoadBytecode flags, args) of
+        (Just file, []) -> Bytecode.load file >>= Bytecode.evalStats >>= output flags
+        (Just _, _)     -> fail "--load-bytecode takes no interpreter or source: it runs the file it is given"
+        (Nothing, _)    -> runSource flags args
+
+output :: Flags -> (Value, Stats.Stats) -> IO ()
+output flags (result, stats) = do
+    print result
+    when (flagStats flags) $ Stats.report stats
+
+runSource :: Flags -> [String] -> IO ()
+runSource flags args = do
     (interp, source) <- case args of
-        [i, file] | Just interp <- lookup i interpreters -> (interp,) <$> readFile file
-        [i]       | Just interp <- lookup i interpreters -> (interp,) <$> getContents
-        _   -> fail $ "Usage: InterpreterStack <interp> [source], <interp> is one of " 
-                   ++ intercalate "," (map fst interpreters)
+        [i, file] | Just interp <- lookup i (interpreters flags) -> (interp,) <$> readFile file
+        [i]       | Just interp <- lookup i (interpreters flags) -> (interp,) <$> getContents
+        _   -> fail $ "Usage: InterpreterStack [--stats] [--compact <n>] [--trace-graphs <n>] [--cores <n,n,...>] [--residualize <file> [--fuel <n>]] [--normalize <file>] [--float] [--save-bytecode <file>] <interp> [source],\n"
+                   ++ "   or: InterpreterStack [--stats] --load-bytecode <file>\n"
+                   ++ "<interp> is one of " 
+                   ++ intercalate "," (map fst (interpreters flags))
+    when (isJust (flagSaveBytecode flags) && take 1 args /= ["vm"]) $
+        fail "--save-bytecode only works with the vm interpreter"
     case Parser.parse source of
         Left err -> fail (show err)
-        Right x -> print =<< interp (EApp (EApp x (EPrim (VInt 0))) (EPrim VSucc))
+        Right x -> do
+            prog <- maybe (return x) (residualize flags x) (flagResidualize flags)
+                        >>= \y -> maybe (return y) (normalize y) (flagNormalize flags)
+                        >>= floatOut flags
+            output flags =<< interp (EApp (EApp prog (EPrim (VInt 0))) (EPrim VSucc))
+
+-- residualize specializes the program with Thyer, writes the residual term to
+-- file and hands it on, so that it can be run by any interpreter.
+residualize :: Flags -> DeBruijn.Exp Value -> FilePath -> IO (DeBruijn.Exp Value)
+residualize flags x file = do
+    (residual, stats) <- Thyer.residualize (thyerConfig flags Thyer.defaultConfig) (flagFuel flags) (toHOAS x)
+    writeFile file (pretty residual ++ "\n")
+    when (flagStats flags) $ Stats.report stats
+    return residual
+
+-- normalize writes the normal form of the program, by NbE, to file and hands
+-- it on.
+normalize :: DeBruijn.Exp Value -> FilePath -> IO (DeBruijn.Exp Value)
+normalize x file = do
+    let nf = NbE.normalize x
+    writeFile file (pretty nf ++ "\n")
+    return nf
+
+-- floatOut floats maximal free expressions out of lambdas, if asked to, so
+-- that every engine gets the sharing full laziness would give it.
+floatOut :: Flags -> DeBruijn.Exp Value -> IO (DeBruijn.Exp Value)
+floatOut flags x
+    | flagFloat flags = do
+        let (floated, stats) = Float.float x
+        when (flagStats flags) $ Stats.report stats
+        return floated
+    | otherwise = return x
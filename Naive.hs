@@ -6,87 +6,153 @@
 -- but, perhaps surprisingly, it passes the tower of interpreters
 -- test.
 
+-- evalNeed is the same tree substitution run call-by-need: see whnf.
+
 module Naive where
 
 import Control.Monad
-import Control.Monad.Trans.Class
-import Control.Monad.Trans.Reader
+import Control.Monad.Trans.State.Strict
 import Data.IntSet (IntSet)
-import System.IO.Unsafe (unsafePerformIO)
 import qualified Data.IntSet as I
-import qualified Data.Supply as Supply
+import qualified Data.IntMap as M
 
 import HOAS
+import qualified Stats
 
+-- Lam and App carry the free variables of the whole term.  The field is
+-- lazy: terms can be infinite, and only some free variable sets are ever
+-- asked for.  Build them with lam and app.
 data Exp a = Var Int
-           | Lam Int (Exp a)
-           | Exp a `App` Exp a
+           | Lam IntSet Int (Exp a)
+           | App IntSet (Exp a) (Exp a)
            | Prim a
+           | Cell Int       -- an argument shared through whnf's heap
            deriving Show
 
-newtype Env a = Env { runEnv :: Supply.Supply Int -> a }
-
-instance Functor Env where
-    fmap f (Env s) = Env (f . s)
+lam :: Int -> Exp a -> Exp a
+lam v e = Lam (I.delete v (freeVars e)) v e
 
-instance Monad Env where
-    return = Env . const
-    Env s >>= f = Env $ \sup ->
-        let (sup1, sup2) = Supply.split2 sup in
-        runEnv (f (s sup1)) sup2
+app :: Exp a -> Exp a -> Exp a
+app f a = App (freeVars f `I.union` freeVars a) f a
 
-newtype Naive a = Naive { unNaive :: Env (Exp a) }
+-- Terms are built with a strict counter for their variables.  Reduction
+-- needs no name supply: see subst.
+newtype Naive a = Naive { unNaive :: State Int (Exp a) }
 
-fresh :: Env Int
-fresh = Env Supply.supplyValue
+fresh :: State Int Int
+fresh = do
+  x <- get
+  put $! x + 1
+  return x
 
 instance Term (Naive a) where
-  Naive left % Naive right = Naive $ liftM2 App left right
+  Naive left % Naive right = Naive $ liftM2 app left right
   fun f = Naive $ do
     x <- fresh
-    Lam x `liftM` (unNaive . f . Naive . return $ Var x)
+    lam x `liftM` (unNaive . f . Naive . return $ Var x)
 
 instance PrimTerm a (Naive a) where
   prim = Naive . return . Prim
 
 freeVars :: Exp a -> IntSet
 freeVars (Var v) = I.singleton v
-freeVars (Lam v e) = I.delete v $ freeVars e
-freeVars (App f a) = freeVars f `I.union` freeVars a
+freeVars (Lam fvs _ _) = fvs
+freeVars (App fvs _ _) = fvs
 freeVars _ = I.empty
 
-subst :: Int -> Exp a -> Exp a -> Env (Exp a)
-subst x s b = sub b
-  where sub e@(Var v) | v == x = return s
-                      | otherwise = return e
-        sub e@(Lam v e') | v == x = return e
-                         | v `I.member` fvs = do
-                             v' <- fresh
-                             e'' <- sub =<< subst v (Var v') e'
-                             return $ Lam v' e''
-                         | otherwise = Lam v `liftM` sub e'
-        sub (App f a) = liftM2 App (sub f) (sub a)
-        sub e = return e
-        fvs = freeVars s
-
-reduce :: Primitive a => Exp a -> Env (Exp a)
-reduce (Lam x e) = Lam x `liftM` reduce e
-reduce (App e1 e2) = do
-  e1' <- reduce e1
-  e2' <- reduce e2
+-- subst scope x s b substitutes s for x in b, scope being the variables bound
+-- around the redex: the free variables of s, and those of b other than x, are
+-- among them.  A binder that would capture a free variable of s is renamed,
+-- by adding the renaming to the substitution, to a variable above everything
+-- in scope where it is, which is therefore not free in its body.  Finding one
+-- that way needs nothing but the binders on the way down, whereas a name
+-- supply would have to be threaded through the whole, lazy, reduction.  fvs
+-- is the free variables of everything being substituted.
+subst :: IntSet -> Int -> Exp a -> Exp a -> Exp a
+subst scope0 x s = sub scope0 (M.singleton x s) (freeVars s)
+  where sub _ m _ e@(Var v) = M.findWithDefault e v m
+        sub scope m fvs e@(Lam _ v e')
+          | v `M.member` m = let m' = M.delete v m in
+                             if M.null m' then e else sub scope m' fvs e
+          | v `I.member` fvs = let v' = above scope in
+              lam v' $ sub (I.insert v' scope) (M.insert v (Var v') m) (I.insert v' fvs) e'
+          | otherwise = lam v $ sub (I.insert v scope) m fvs e'
+        sub scope m fvs (App _ f a) = app (sub scope m fvs f) (sub scope m fvs a)
+        sub _ _ _ e = e
+        above = maybe 0 ((+1) . fst) . I.maxView
+
+-- reduce scope e normalizes e, scope being the variables bound around it.
+reduce :: Primitive a => IntSet -> Exp a -> Exp a
+reduce scope (Lam _ x e) = lam x (reduce (I.insert x scope) e)
+reduce scope (App _ e1 e2) =
   case e1' of
-    Lam x e -> reduce =<< subst x e2' e
+    Lam _ x e -> reduce scope (subst scope x e2' e)
     Prim a -> case e2' of
-      Prim b -> return . Prim $ a `apply` b
-      _ -> return $ App e1' e2'
-    _ -> return $ App e1' e2'
-reduce e = return e
+      Prim b -> Prim $ a `apply` b
+      _ -> app e1' e2'
+    _ -> app e1' e2'
+  where e1' = reduce scope e1
+        e2' = reduce scope e2
+reduce _ e = e
 
 eval :: Primitive a => Naive a -> a
-eval m = case e of
+eval m = case reduce I.empty (evalState (unNaive m) 0) of
   Prim a -> a
   _ -> error "Not a prim!"
-  where 
-  e = unsafePerformIO $ do
-        supply <- Supply.newSupply 0 succ
-        return $ runEnv (reduce =<< unNaive m) supply
+
+-- Call-by-need.  whnf reduces a closed term to weak head normal form, never
+-- going under a lambda, and substitutes an argument that is not yet a value
+-- as a Cell: an index into an explicit heap, whose entry is overwritten with
+-- its weak head normal form the first time it is forced.  Every argument it
+-- substitutes is closed, so subst never has to rename.
+data Heap a = Heap {
+  heapCells :: !(M.IntMap (Exp a)),
+  heapDone  :: !IntSet,         -- cells holding their weak head normal form
+  heapHits  :: !Int             -- forces of cells in heapDone
+}
+
+whnf :: Primitive a => Exp a -> State (Heap a) (Exp a)
+whnf (App _ f a) = do
+  f' <- whnf f
+  case f' of
+    Lam _ x body -> do
+      arg <- share a
+      whnf (subst I.empty x arg body)
+    Prim p -> do
+      a' <- whnf a
+      return $ case a' of
+        Prim b -> Prim $ p `apply` b
+        _ -> app f' a'
+    _ -> return $ app f' a
+whnf (Cell i) = force i
+whnf e = return e
+
+share :: Exp a -> State (Heap a) (Exp a)
+share e@(App {}) = do
+  h <- get
+  let i = M.size (heapCells h)
+  put $! h { heapCells = M.insert i e (heapCells h) }
+  return (Cell i)
+share e = return e
+
+force :: Primitive a => Int -> State (Heap a) (Exp a)
+force i = do
+  h <- get
+  if i `I.member` heapDone h
+    then do
+      put $! h { heapHits = heapHits h + 1 }
+      return (heapCells h M.! i)
+    else do
+      e <- whnf (heapCells h M.! i)
+      h' <- get
+      put $! h' { heapCells = M.insert i e (heapCells h'), heapDone = I.insert i (heapDone h') }
+      return e
+
+evalNeedStats :: Primitive a => Naive a -> (a, Stats.Stats)
+evalNeedStats m = case runState (whnf (evalState (unNaive m) 0)) (Heap M.empty I.empty 0) of
+  (Prim a, h) -> (a, [ ("naive.cells", M.size (heapCells h))
+                     , ("naive.cell-hits", heapHits h) ])
+  _ -> error "Not a prim!"
+
+evalNeed :: Primitive a => Naive a -> a
+evalNeed = fst . evalNeedStats
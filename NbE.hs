@@ -0,0 +1,53 @@
+-- Normalization by evaluation.  Terms are evaluated into Haskell functions,
+-- as in Reference, but the semantic domain also has neutral terms, a
+-- variable applied to values, so that a value can be quoted back into a term:
+-- a lambda is quoted by applying it to a fresh variable and quoting the
+-- result.  Arguments are Haskell thunks, so evaluation is call-by-need.
+
+module NbE (eval, normalize) where
+
+import DeBruijn (Exp(..))
+import HOAS (Primitive(..))
+
+data Value a
+    = VLam (Value a -> Value a)
+    | VPrim a
+    | VNeutral (Neutral a)
+
+data Neutral a
+    = NVar Int                      -- by deBruijn level
+    | NApp (Neutral a) (Value a)
+    | NPrimApp a (Neutral a)        -- a primitive applied to a neutral term
+
+evaluate :: (Primitive a) => [Value a] -> Exp a -> Value a
+evaluate env (ELam body) = VLam (\x -> evaluate (x:env) body)
+evaluate env (EApp t u)  = evaluate env t `vapply` evaluate env u
+evaluate env (EVar z)    = env !! z
+evaluate _   (EPrim p)   = VPrim p
+
+vapply :: (Primitive a) => Value a -> Value a -> Value a
+vapply (VLam f)     x            = f x
+vapply (VPrim a)    (VPrim b)    = VPrim (a `apply` b)
+vapply (VPrim a)    (VNeutral n) = VNeutral (NPrimApp a n)
+vapply (VPrim _)    (VLam _)     = error "Type error!"
+vapply (VNeutral n) x            = VNeutral (NApp n x)
+
+-- quote d v reads v back as a term under d binders.
+quote :: Int -> Value a -> Exp a
+quote d (VLam f)     = ELam (quote (d+1) (f (VNeutral (NVar d))))
+quote _ (VPrim p)    = EPrim p
+quote d (VNeutral n) = quoteNeutral d n
+
+quoteNeutral :: Int -> Neutral a -> Exp a
+quoteNeutral d (NVar l)       = EVar (d - 1 - l)
+quoteNeutral d (NApp n v)     = EApp (quoteNeutral d n) (quote d v)
+quoteNeutral d (NPrimApp a n) = EApp (EPrim a) (quoteNeutral d n)
+
+eval :: (Primitive a) => Exp a -> a
+eval e = case evaluate [] e of
+    VPrim a -> a
+    _       -> error "Not a prim!"
+
+-- normalize gives the normal form of a closed term, when it has one.
+normalize :: (Primitive a) => Exp a -> Exp a
+normalize = quote 0 . evaluate []
@@ -0,0 +1,447 @@
+-- Lamping's optimal reduction, on sharing graphs with the bookkeeping of
+-- Gonthier, Abadi and Lévy, as presented in
+-- The Optimal Implementation of Functional Programming Languages
+-- by Andrea Asperti and Stefano Guerrini (1998).
+--
+-- A term becomes an interaction net of lambdas, applications, fans,
+-- croissants and brackets, each with a level, plus erasers and primitives.
+-- [x]n is a croissant at level n; [\x.M]n is a lambda at level n over [M]n;
+-- [M N]n is an application at level n of [M]n to [N]n+1, every free variable
+-- of the argument leaving through a bracket at level n.  Uses of a variable
+-- are gathered by fans at the level they meet.
+--
+-- Only active pairs on the path from the root to the head are reduced, so a
+-- term that has a weak head normal form gets one even if it has no normal
+-- form.  Reading a term back out of the net follows the same paths, keeping
+-- the context of the geometry of interaction to choose a side at every fan
+-- and to tell apart the copies of a shared lambda.
+
+module Optimal
+    ( eval, evalStats, normalize
+    -- for other engines over the same nets
+    , Kind(..), arity, Builder(..), translate, Rule(..), rule, ruleName
+    , Context, up, exit
+    ) where
+
+import DeBruijn (Exp(..))
+import qualified HOAS
+import qualified Column
+import qualified Stats
+import qualified Data.Map as Map
+import qualified Data.IntMap as IntMap
+import Data.IORef
+import Data.Char (toLower)
+import Data.List (elemIndex)
+import Data.Maybe (fromMaybe)
+import Control.Applicative
+import Control.Monad (forM, forM_, foldM)
+
+type NodeIx = Int
+
+-- Every node has three ports, 0 being the principal one.
+type Port = Int
+
+port :: NodeIx -> Int -> Port
+port n i = 3 * n + i
+
+nodeOf, slotOf :: Port -> Int
+nodeOf = (`div` 3)
+slotOf = (`mod` 3)
+
+-- Lambda:    1 = body, 2 = variable
+-- Apply:     1 = result, 2 = argument; principal = function
+-- Fan:       1, 2 = the two sharers
+-- Croissant, Bracket: 1 = the side with the higher levels
+-- Op:        1 = result; principal = argument.  A primitive waiting for its
+--            argument, made when an application meets a primitive.
+-- Root:      0, which is not principal: the root of the whole term.
+data Kind = Root | Lambda | Apply | Fan | Croissant | Bracket | Erase | Prim | Op
+    deriving (Eq, Ord, Enum, Show)
+
+arity :: Kind -> Int
+arity k = case k of
+    Lambda    -> 2
+    Apply     -> 2
+    Fan       -> 2
+    Croissant -> 1
+    Bracket   -> 1
+    Op        -> 1
+    _         -> 0
+
+-- Whether a node has a level.  Those that do not are closed, and pass
+-- through the others unchanged.
+leveled :: Kind -> Bool
+leveled k = k `elem` [Lambda, Apply, Fan, Croissant, Bracket]
+
+data Net a = Net {
+    netSize  :: IORef Int,
+    netKind  :: Column.UColumn Int,
+    netLevel :: Column.UColumn Int,
+    netLinks :: Column.UColumn Int,     -- the port each port is linked to
+    netPrims :: Column.BColumn a,       -- the values of Prim and Op nodes
+    netRules :: IORef (Map.Map String Int)
+  }
+
+newNet :: IO (Net a)
+newNet = Net <$> newIORef 0 <*> Column.new 1024 <*> Column.new 1024 <*> Column.new 3072
+             <*> Column.new 1024 <*> newIORef Map.empty
+
+netStats :: Net a -> IO Stats.Stats
+netStats net = do
+    size <- readIORef (netSize net)
+    rules <- Map.toList <$> readIORef (netRules net)
+    return $ [ ("optimal.nodes", size)
+             , ("optimal.interactions", sum (map snd rules)) ]
+          ++ [ ("optimal." ++ rule, n) | (rule, n) <- rules ]
+
+countRule :: Net a -> String -> IO ()
+countRule net rule = do
+    rules <- readIORef (netRules net)
+    writeIORef (netRules net) $! Map.insertWith (+) rule 1 rules
+
+newNode :: Net a -> Kind -> Int -> IO NodeIx
+newNode net kind level = do
+    n <- readIORef (netSize net)
+    writeIORef (netSize net) $! n + 1
+    Column.grow (netKind net) n
+    Column.grow (netLevel net) n
+    Column.grow (netLinks net) (port n 2)
+    Column.grow (netPrims net) n
+    Column.write (netKind net) n (fromEnum kind)
+    Column.write (netLevel net) n level
+    return n
+
+newValued :: Net a -> Kind -> a -> IO NodeIx
+newValued net kind x = do
+    n <- newNode net kind 0
+    Column.write (netPrims net) n x
+    return n
+
+kindOf :: Net a -> NodeIx -> IO Kind
+kindOf net n = toEnum <$> Column.read (netKind net) n
+
+levelOf :: Net a -> NodeIx -> IO Int
+levelOf net = Column.read (netLevel net)
+
+valueOf :: Net a -> NodeIx -> IO a
+valueOf net = Column.read (netPrims net)
+
+partner :: Net a -> Port -> IO Port
+partner net = Column.read (netLinks net)
+
+link :: Net a -> Port -> Port -> IO ()
+link net p q = do
+    Column.write (netLinks net) p q
+    Column.write (netLinks net) q p
+
+isPrincipal :: Net a -> Port -> IO Bool
+isPrincipal net p
+    | slotOf p /= 0 = return False
+    | otherwise     = (/= Root) <$> kindOf net (nodeOf p)
+
+-- The operations translate needs of a net whose nodes are n and ports p.
+data Builder n p a = Builder {
+    buildNode :: Kind -> Int -> IO n,
+    buildPrim :: a -> IO n,
+    buildPort :: n -> Int -> p,
+    buildLink :: p -> p -> IO ()
+  }
+
+-- translate b n e builds e at level n.  It returns the port the root of e is
+-- to be linked to, and for each free variable of e, by deBruijn index, the
+-- port its uses are to be linked to.
+translate :: Builder n p a -> Int -> Exp a -> IO (p, IntMap.IntMap p)
+translate b n e = case e of
+    EVar i -> do
+        c <- buildNode b Croissant n
+        return (port c 1, IntMap.singleton i (port c 0))
+    ELam body -> do
+        (r, fv) <- translate b n body
+        l <- buildNode b Lambda n
+        link (port l 1) r
+        v <- maybe ((`port` 0) <$> buildNode b Erase n) return (IntMap.lookup 0 fv)
+        link (port l 2) v
+        return (port l 0, IntMap.mapKeysMonotonic (subtract 1) (IntMap.delete 0 fv))
+    EApp f x -> do
+        (fr, ffv) <- translate b n f
+        (xr, xfv) <- translate b (n+1) x
+        xfv' <- forM xfv $ \p -> do
+            k <- buildNode b Bracket n
+            link (port k 1) p
+            return (port k 0)
+        a <- buildNode b Apply n
+        link (port a 0) fr
+        link (port a 2) xr
+        fv <- sequence (IntMap.unionWith share (return <$> ffv) (return <$> xfv'))
+        return (port a 1, fv)
+    EPrim x -> do
+        p <- buildPrim b x
+        return (port p 0, IntMap.empty)
+    where
+    port = buildPort b
+    link = buildLink b
+    share mp mq = do
+        p <- mp
+        q <- mq
+        fan <- buildNode b Fan n
+        link (port fan 1) p
+        link (port fan 2) q
+        return (port fan 0)
+
+-- What an active pair is rewritten by, from the kinds and levels of its
+-- nodes.
+data Rule
+    = Beta                  -- an application, then a lambda
+    | ApplyPrim             -- an application, then a primitive
+    | RunOp                 -- an Op, then a primitive
+    | Annihilate
+    | Commute Int Int       -- the levels to give the copies of each node
+    | Flip Rule             -- the rule, with the nodes the other way round
+    | Invalid String
+
+rule :: Kind -> Int -> Kind -> Int -> Rule
+rule ka la kb lb = case (ka, kb) of
+    (Apply, Lambda)
+        | la == lb  -> Beta
+        | otherwise -> Invalid $ "Bug - application at level " ++ show la ++ " meets lambda at " ++ show lb
+    (Apply, Prim)   -> ApplyPrim
+    (Op, Prim)      -> RunOp
+    (Op, Lambda)    -> Invalid "Can't apply primitive to lambda"
+    _ | (kb, ka) `elem` [(Apply, Lambda), (Apply, Prim), (Op, Prim), (Op, Lambda)] ->
+          Flip (rule kb lb ka la)
+      | ka == kb && la == lb && ka `elem` [Fan, Croissant, Bracket] -> Annihilate
+      | leveled ka && leveled kb && la == lb ->
+          Invalid $ "Bug - " ++ kindName ka ++ " and " ++ kindName kb ++ " meet at level " ++ show la
+      | leveled ka && leveled kb && la < lb -> Commute la (lb + shift ka)
+      | leveled ka && leveled kb            -> Commute (la + shift kb) lb
+      | otherwise                           -> Commute la lb
+    where
+    -- How passing through a node changes the level of what passes.
+    shift Croissant = -1
+    shift Bracket   = 1
+    shift _         = 0
+
+-- The name a rule is counted under in the stats.
+ruleName :: Kind -> Kind -> Rule -> String
+ruleName ka kb r = case r of
+    Beta       -> "beta"
+    ApplyPrim  -> "apply-prim"
+    RunOp      -> "run-prim"
+    Annihilate -> "annihilate-" ++ kindName ka
+    Commute _ _
+        | ka == Erase -> "erase-" ++ kindName kb
+        | kb == Erase -> "erase-" ++ kindName ka
+        | otherwise   -> "commute-" ++ kindName (min ka kb) ++ "-" ++ kindName (max ka kb)
+    Flip r'    -> ruleName kb ka r'
+    Invalid _  -> "invalid"
+
+kindName :: Kind -> String
+kindName = map toLower . show
+
+-- rewrite rewrites the active pair of a and b.
+rewrite :: (HOAS.Primitive a) => Net a -> NodeIx -> NodeIx -> IO ()
+rewrite net a0 b0 = do
+    ka0 <- kindOf net a0
+    kb0 <- kindOf net b0
+    la0 <- levelOf net a0
+    lb0 <- levelOf net b0
+    go a0 ka0 b0 kb0 (rule ka0 la0 kb0 lb0)
+    where
+    go a ka b kb r = case r of
+        Flip r'     -> go b kb a ka r'
+        Invalid msg -> fail msg
+        _ -> do
+            countRule net (ruleName ka kb r)
+            case r of
+                Beta -> do
+                    fuse (port a 1) (port b 1)
+                    fuse (port a 2) (port b 2)
+                ApplyPrim -> do
+                    op <- newValued net Op =<< valueOf net b
+                    result <- partner net (port a 1)
+                    arg <- partner net (port a 2)
+                    link net (port op 1) result
+                    link net (port op 0) arg
+                RunOp -> do
+                    f <- valueOf net a
+                    x <- valueOf net b
+                    result <- newValued net Prim (f `HOAS.apply` x)
+                    link net (port result 0) =<< partner net (port a 1)
+                Annihilate ->
+                    forM_ [1 .. arity ka] $ \i -> fuse (port a i) (port b i)
+                Commute la' lb' -> commute a ka la' b kb lb'
+                _ -> return ()
+
+    -- fuse p q joins what p and q were linked to.  Used pairwise, in order,
+    -- it also gets wires from a node of the pair to itself or the other right.
+    fuse p q = do
+        p' <- partner net p
+        q' <- partner net q
+        link net p' q'
+
+    -- commute lets x and y pass through each other: a copy of y, at level
+    -- ly', takes the place of each auxiliary port of x, and the other way
+    -- around.
+    commute x kx lx' y ky ly' = do
+        ys <- forM [1 .. arity kx] $ \_ -> copy y ky ly'
+        xs <- forM [1 .. arity ky] $ \_ -> copy x kx lx'
+        let moved = [ (port x i, port y' 0) | (i, y') <- zip [1..] ys ]
+                 ++ [ (port y j, port x' 0) | (j, x') <- zip [1..] xs ]
+        forM_ moved $ \(old, new) -> do
+            q <- partner net old
+            link net new (fromMaybe q (lookup q moved))
+        forM_ (zip [1..] ys) $ \(i, y') ->
+            forM_ (zip [1..] xs) $ \(j, x') ->
+                link net (port y' j) (port x' i)
+
+    copy n k l = do
+        n' <- newNode net k l
+        Column.write (netPrims net) n' =<< valueOf net n
+        return n'
+
+-- The context of a path: a stack of symbols for each level.  Levels past the
+-- end of the list are empty.
+type Context = [[Symbol]]
+
+data Symbol
+    = Side Int                  -- which auxiliary port of a fan
+    | Box                       -- the level a croissant adds
+    | Pair [Symbol] [Symbol]    -- the two levels a bracket merges
+    deriving (Eq)
+
+padTo :: Int -> Context -> Context
+padTo k ctx = ctx ++ replicate (k - length ctx) []
+
+atLevel :: Int -> Context -> [Symbol]
+atLevel k ctx = padTo (k+1) ctx !! k
+
+setLevel :: Int -> [Symbol] -> Context -> Context
+setLevel k s ctx = let c = padTo (k+1) ctx in take k c ++ [s] ++ drop (k+1) c
+
+-- The levels below k, which tell which copy of a node at level k a path is
+-- going through.
+prefix :: Int -> Context -> Context
+prefix k = take k . padTo k
+
+-- Going from an auxiliary port to the principal one, and back.
+up :: Kind -> Int -> Int -> Context -> Maybe Context
+up Fan       k i ctx = Just (setLevel k (Side i : atLevel k ctx) ctx)
+up Croissant k _ ctx = let c = padTo k ctx in Just (take k c ++ [[Box]] ++ drop k c)
+up Bracket   k _ ctx = let c = padTo (k+2) ctx in Just (take k c ++ [[Pair (c !! k) (c !! (k+1))]] ++ drop (k+2) c)
+up _         _ _ ctx = Just ctx
+
+down :: Kind -> Int -> Context -> Maybe Context
+down Fan       k ctx = case atLevel k ctx of
+    Side _ : rest -> Just (setLevel k rest ctx)
+    _             -> Nothing
+down Croissant k ctx = let c = padTo (k+1) ctx in Just (take k c ++ drop (k+1) c)
+down Bracket   k ctx = case atLevel k ctx of
+    Pair x y : _ -> let c = padTo (k+1) ctx in Just (take k c ++ [x, y] ++ drop (k+1) c)
+    _            -> Nothing
+down _         _ ctx = Just ctx
+
+-- exit k l ctx says by which auxiliary port a path coming in by the principal
+-- port of a control node at level l goes out, and with what context.
+exit :: Kind -> Int -> Context -> Maybe (Int, Context)
+exit k l ctx = do
+    ctx' <- down k l ctx
+    let side = case atLevel l ctx of
+            Side s : _ | k == Fan -> s
+            _                     -> 1
+    return (side, ctx')
+
+-- What the head of a term turned out to be, and what was waiting on it,
+-- innermost first: applications to read the arguments of, and primitives.
+data Head a
+    = HeadLambda NodeIx Context
+    | HeadVar NodeIx Context        -- at the variable port of this lambda
+    | HeadPrim a
+
+data Pending a
+    = PendingApply NodeIx Context
+    | PendingOp a
+
+-- whnf reduces the term linked to stand to weak head normal form, ctx being
+-- the context at stand, and says where its head is.  It walks towards the
+-- head, leaving auxiliary ports by the principal one; when the node there
+-- faces back it is an active pair, and once that is rewritten the walk
+-- starts over.
+whnf :: (HOAS.Primitive a) => Net a -> Context -> Port -> IO (Head a, [Pending a])
+whnf net ctx0 stand = start
+    where
+    start = enter ctx0 [] =<< partner net stand
+
+    enter ctx pending p = do
+        let n = nodeOf p
+            i = slotOf p
+        k <- kindOf net n
+        l <- levelOf net n
+        case (k, i) of
+            (Lambda, 0) -> return (HeadLambda n ctx, pending)
+            (Prim, 0)   -> (\x -> (HeadPrim x, pending)) <$> valueOf net n
+            (Lambda, 2) -> return (HeadVar n ctx, pending)
+            (Apply, 1)  -> leave ctx (PendingApply n ctx : pending) n
+            (Op, 1)     -> valueOf net n >>= \x -> leave ctx (PendingOp x : pending) n
+            (_, 0) | k `elem` [Fan, Croissant, Bracket] -> do
+                -- Coming in by the principal port: the context says which
+                -- way out.
+                (side, ctx') <- maybe (stuck k) return (exit k l ctx)
+                enter ctx' pending =<< partner net (port n side)
+            _ | k `elem` [Fan, Croissant, Bracket] ->
+                maybe (stuck k) (\ctx' -> leave ctx' pending n) (up k l i ctx)
+            _ -> stuck k
+
+    leave ctx pending n = do
+        q <- partner net (port n 0)
+        active <- isPrincipal net q
+        if active
+            then rewrite net n (nodeOf q) >> start
+            else enter ctx pending q
+
+    stuck k = fail $ "Optimal: stuck at " ++ show k
+
+-- readback reads the term linked to stand back out of the net, normalizing
+-- it as it goes.  scope has the lambdas around it, innermost first, with the
+-- context that picks out their copy.
+readback :: (HOAS.Primitive a) => Net a -> Context -> Port -> [(NodeIx, Context)] -> IO (Exp a)
+readback net ctx stand scope = do
+    (hd, pending) <- whnf net ctx stand
+    e <- case hd of
+        HeadPrim x -> return (EPrim x)
+        HeadLambda n ctx' -> do
+            l <- levelOf net n
+            ELam <$> readback net ctx' (port n 1) ((n, prefix l ctx') : scope)
+        HeadVar n ctx' -> do
+            l <- levelOf net n
+            maybe (fail "Optimal: variable without a binder") (return . EVar)
+                  (elemIndex (n, prefix l ctx') scope)
+    foldM apply e pending
+    where
+    apply e (PendingApply n ctx') = EApp e <$> readback net ctx' (port n 2) scope
+    apply e (PendingOp f)         = return (EApp (EPrim f) e)
+
+build :: Exp a -> IO (Net a, Port)
+build t = do
+    net <- newNet
+    root <- newNode net Root 0
+    (p, _) <- translate (Builder (newNode net) (newValued net Prim) port (link net)) 0 t
+    link net (port root 0) p
+    return (net, port root 0)
+
+evalStats :: (HOAS.Primitive a) => Exp a -> IO (a, Stats.Stats)
+evalStats t = do
+    (net, root) <- build t
+    (hd, pending) <- whnf net [] root
+    case (hd, pending) of
+        (HeadPrim x, []) -> (,) x <$> netStats net
+        _ -> fail "Not a prim!"
+
+eval :: (HOAS.Primitive a) => Exp a -> IO a
+eval = fmap fst . evalStats
+
+-- normalize gives the normal form of a term, when it has one.
+normalize :: (HOAS.Primitive a) => Exp a -> IO (Exp a, Stats.Stats)
+normalize t = do
+    (net, root) <- build t
+    e <- readback net [] root []
+    (,) e <$> netStats net
@@ -0,0 +1,296 @@
+-- Optimal reduction on several cores.  The net is Optimal's sharing graph,
+-- with its links in TVars so that active pairs can be rewritten from many
+-- threads at once, each rewrite one STM transaction.
+--
+-- The main thread walks to the head as Optimal.whnf does and rewrites the
+-- active pair it finds there, so a run ends when the sequential one would.
+-- Every active pair a rewrite makes is also pushed on the rewriting thread's
+-- deque, for the workers, which pop their own deque from the top and steal
+-- from the bottom of the others'.  What the workers do is speculative, and
+-- it is cut off at cfgHorizon rewrites from the main walk: reducing every
+-- active pair of a term such as fix would never stop.
+
+module Parallel (Config(..), defaultConfig, eval, evalStats) where
+
+import DeBruijn (Exp(..))
+import qualified HOAS
+import qualified Stats
+import Optimal (Kind(..), arity, Builder(..), translate, Rule(..), rule, ruleName, up, exit)
+import qualified Data.Map as Map
+import qualified Data.Sequence as Seq
+import Data.Sequence (ViewL(..), ViewR(..), (|>))
+import Data.IORef
+import Data.Maybe (fromMaybe)
+import Control.Applicative
+import Control.Concurrent
+import Control.Concurrent.STM
+import Control.Exception (SomeException, evaluate, finally, throwIO)
+import Control.Monad (forM, forM_, when, replicateM)
+import GHC.Clock (getMonotonicTimeNSec)
+
+data Config = Config {
+    cfgCores   :: [Int],    -- run with each of these numbers of cores in
+                            -- turn, reporting the speedup over the first;
+                            -- none means once, with the capabilities there are
+    cfgHorizon :: Int,      -- how many rewrites away from the main walk the
+                            -- workers go on speculating
+    cfgBacklog :: Int       -- how many pairs a deque holds at most; the
+                            -- oldest are dropped
+  }
+
+defaultConfig :: Config
+defaultConfig = Config { cfgCores = [], cfgHorizon = 16, cfgBacklog = 4096 }
+
+data Node a = Node {
+    nodeKind  :: !Kind,
+    nodeLevel :: !Int,
+    nodeValue :: a,                 -- of Prim and Op nodes
+    nodeLink0 :: !(TVar (Port a)),
+    nodeLink1 :: !(TVar (Port a)),
+    nodeLink2 :: !(TVar (Port a)),
+    nodeAlive :: !(TVar Bool)
+  }
+
+data Port a = Port !(Node a) !Int
+
+instance Eq (Port a) where
+    Port n i == Port m j = i == j && nodeAlive n == nodeAlive m
+
+type Pair a = (Node a, Node a)
+
+linkVar :: Port a -> TVar (Port a)
+linkVar (Port n 0) = nodeLink0 n
+linkVar (Port n 1) = nodeLink1 n
+linkVar (Port n _) = nodeLink2 n
+
+newNode :: Kind -> Int -> a -> STM (Node a)
+newNode k l x = Node k l x <$> newTVar unlinked <*> newTVar unlinked <*> newTVar unlinked <*> newTVar True
+    where
+    unlinked = error "Parallel: unlinked port"
+
+noValue :: a
+noValue = error "Parallel: not a primitive"
+
+principal :: Port a -> Bool
+principal (Port n i) = i == 0 && nodeKind n /= Root
+
+partner :: Port a -> STM (Port a)
+partner = readTVar . linkVar
+
+-- link gives the active pair it makes, if it makes one.
+link :: Port a -> Port a -> STM [Pair a]
+link p@(Port n _) q@(Port m _) = do
+    writeTVar (linkVar p) q
+    writeTVar (linkVar q) p
+    return [ (n, m) | principal p && principal q ]
+
+-- rewrite rewrites the pair of a and b if it is still active, giving the
+-- name of the rule and the pairs that it made active.  It follows
+-- Optimal.rewrite.
+rewrite :: (HOAS.Primitive a) => Node a -> Node a -> STM (Maybe (String, [Pair a]))
+rewrite a0 b0 = do
+    alive <- readTVar (nodeAlive a0)
+    p <- partner (Port a0 0)
+    if not alive || p /= Port b0 0 then return Nothing else do
+    writeTVar (nodeAlive a0) False
+    writeTVar (nodeAlive b0) False
+    go a0 b0 (rule (nodeKind a0) (nodeLevel a0) (nodeKind b0) (nodeLevel b0))
+    where
+    go a b r = case r of
+        Flip r'     -> go b a r'
+        Invalid msg -> throwSTM (userError msg)
+        _ -> do
+            made <- case r of
+                Beta -> (++) <$> fuse (Port a 1) (Port b 1) <*> fuse (Port a 2) (Port b 2)
+                ApplyPrim -> do
+                    op <- newNode Op 0 (nodeValue b)
+                    result <- partner (Port a 1)
+                    arg <- partner (Port a 2)
+                    (++) <$> link (Port op 1) result <*> link (Port op 0) arg
+                RunOp -> do
+                    result <- newNode Prim 0 (nodeValue a `HOAS.apply` nodeValue b)
+                    link (Port result 0) =<< partner (Port a 1)
+                Annihilate ->
+                    concat <$> forM [1 .. arity (nodeKind a)] (\i -> fuse (Port a i) (Port b i))
+                Commute la lb -> commute a la b lb
+                _ -> return []
+            return (Just (ruleName (nodeKind a) (nodeKind b) r, made))
+
+    fuse p q = do
+        p' <- partner p
+        q' <- partner q
+        link p' q'
+
+    commute x lx y ly = do
+        ys <- replicateM (arity (nodeKind x)) (newNode (nodeKind y) ly (nodeValue y))
+        xs <- replicateM (arity (nodeKind y)) (newNode (nodeKind x) lx (nodeValue x))
+        let moved = [ (Port x i, Port y' 0) | (i, y') <- zip [1..] ys ]
+                 ++ [ (Port y j, Port x' 0) | (j, x') <- zip [1..] xs ]
+        outer <- forM moved $ \(old, new) -> do
+            q <- partner old
+            link new (fromMaybe q (lookup q moved))
+        forM_ (zip [1..] ys) $ \(i, y') ->
+            forM_ (zip [1..] xs) $ \(j, x') ->
+                link (Port y' j) (Port x' i)
+        return (concat outer)
+
+-- The deques of pairs to speculate on, each with its distance from the main
+-- walk.  The main thread's is the first; it only pushes to it, so it is
+-- kept to poolBacklog pairs, the oldest being dropped, and with no workers
+-- nothing is pushed at all.  Idle workers wait for poolPushes to move, which
+-- it does whenever a deque is pushed to.
+data Pool a = Pool {
+    poolDeques  :: [IORef (Seq.Seq (Pair a, Int))],
+    poolPushes  :: TVar Int,
+    poolDone    :: TVar Bool,
+    poolHorizon :: Int,
+    poolBacklog :: Int
+  }
+
+-- What one thread did.
+data Tally = Tally {
+    tallyRules  :: IORef (Map.Map String Int),
+    tallySteals :: Stats.Counter
+  }
+
+newTally :: IO Tally
+newTally = Tally <$> newIORef Map.empty <*> Stats.newCounter
+
+-- done records a rewrite by the thread with deque w, at distance d.
+done :: Pool a -> Int -> Tally -> Int -> (String, [Pair a]) -> IO ()
+done pool w tally d (name, made) = do
+    rules <- readIORef (tallyRules tally)
+    writeIORef (tallyRules tally) $! Map.insertWith (+) name 1 rules
+    when (d < poolHorizon pool && not (null made)) $ do
+        atomicModifyIORef' (poolDeques pool !! w) (\s -> (trim (foldl (|>) s [ (p, d+1) | p <- made ]), ()))
+        atomically $ modifyTVar' (poolPushes pool) (+1)
+    where
+    trim s = Seq.drop (Seq.length s - poolBacklog pool) s
+
+worker :: (HOAS.Primitive a) => Pool a -> Int -> Tally -> IO ()
+worker pool w tally = loop
+    where
+    deques = poolDeques pool
+    mine = deques !! w
+    others = drop (w+1) deques ++ take w deques
+    loop = do
+        pushes <- readTVarIO (poolPushes pool)
+        stop <- readTVarIO (poolDone pool)
+        if stop then return () else do
+        item <- atomicModifyIORef mine $ \s -> case Seq.viewr s of
+            EmptyR  -> (s, Nothing)
+            s' :> x -> (s', Just x)
+        item' <- maybe (steal others) (return . Just) item
+        case item' of
+            Nothing -> idle pushes
+            Just ((a, b), d) -> do
+                r <- atomically (rewrite a b)
+                maybe (return ()) (done pool w tally d) r
+        loop
+    -- Pushes since the deques were looked at, or the end of the run, wake
+    -- the worker; pushes before it will have been seen.
+    idle pushes = atomically $ do
+        stop <- readTVar (poolDone pool)
+        now <- readTVar (poolPushes pool)
+        when (not stop && now == pushes) retry
+    steal [] = return Nothing
+    steal (q : qs) = do
+        item <- atomicModifyIORef q $ \s -> case Seq.viewl s of
+            EmptyL  -> (s, Nothing)
+            x :< s' -> (s', Just x)
+        case item of
+            Nothing -> steal qs
+            Just _  -> Stats.tick (tallySteals tally) >> return item
+
+-- whnf is the main thread's walk from the root to a primitive.  It carries
+-- the context through the control nodes as Optimal.whnf does.  A node that a
+-- worker rewrote under it sends it back to the root.
+whnf :: (HOAS.Primitive a) => Pool a -> Tally -> Port a -> IO a
+whnf pool tally root = start
+    where
+    start = enter [] =<< atomically (partner root)
+    stuck k = fail $ "Parallel: stuck at " ++ show k
+    enter ctx (Port n i) = case (nodeKind n, i) of
+        (Prim, 0)   -> return (nodeValue n)
+        (Lambda, _) -> fail "Not a prim!"
+        (k, 0) | k `elem` [Fan, Croissant, Bracket] ->
+            case exit k (nodeLevel n) ctx of
+                Nothing           -> stuck k
+                Just (side, ctx') -> maybe start (enter ctx') =<< follow n side
+        (k, _) | k `elem` [Fan, Croissant, Bracket] ->
+            maybe (stuck k) (\ctx' -> leave ctx' n) (up k (nodeLevel n) i ctx)
+        (k, 1) | k `elem` [Apply, Op] -> leave ctx n
+        (k, _)      -> stuck k
+    -- follow n i is the partner of port i of n, unless n has been rewritten.
+    follow n i = atomically $ do
+        alive <- readTVar (nodeAlive n)
+        if alive then Just <$> partner (Port n i) else return Nothing
+    leave ctx n = do
+        step <- atomically $ do
+            alive <- readTVar (nodeAlive n)
+            if not alive then return Nothing else do
+            q@(Port m _) <- partner (Port n 0)
+            if principal q
+                then fmap Left <$> rewrite n m
+                else return (Just (Right q))
+        case step of
+            Nothing         -> start
+            Just (Left r)   -> done pool 0 tally 0 r >> start
+            Just (Right q)  -> enter ctx q
+
+-- run evaluates t with the given number of workers besides the main thread.
+run :: (HOAS.Primitive a) => Config -> Int -> Exp a -> IO (a, Stats.Stats)
+run cfg workers t = do
+    seeds <- newIORef []
+    root <- atomically (newNode Root 0 noValue)
+    let builder = Builder {
+            buildNode = \k l -> atomically (newNode k l noValue),
+            buildPrim = \x -> atomically (newNode Prim 0 x),
+            buildPort = Port,
+            buildLink = \p q -> atomically (link p q) >>= \made -> modifyIORef seeds (made ++)
+          }
+    (p, _) <- translate builder 0 t
+    buildLink builder (Port root 0) p
+    seeded <- if workers == 0 then return [] else take (cfgBacklog cfg) <$> readIORef seeds
+    deques <- forM [0 .. workers] $ \w ->
+        newIORef (Seq.fromList (if w == 0 then [ (pair, 0) | pair <- seeded ] else []))
+    pushes <- newTVarIO 0
+    stop <- newTVarIO False
+    let horizon = if workers == 0 then 0 else cfgHorizon cfg
+        pool = Pool deques pushes stop horizon (cfgBacklog cfg)
+    tallies <- replicateM (workers + 1) newTally
+    finished <- forM (zip [1 .. workers] (tail tallies)) $ \(w, tally) -> do
+        mvar <- newEmptyMVar :: IO (MVar (Either SomeException ()))
+        _ <- forkFinally (worker pool w tally) (putMVar mvar)
+        return mvar
+    x <- whnf pool (head tallies) (Port root 0) `finally` atomically (writeTVar stop True)
+    -- A worker that failed, say on an invalid pair, fails the run.
+    mapM_ (either throwIO return) =<< mapM takeMVar finished
+    rules <- mapM (readIORef . tallyRules) tallies
+    steals <- mapM (Stats.readCounter . tallySteals) tallies
+    let total = Map.unionsWith (+) rules
+        count = sum . Map.elems
+    return (x, [ ("parallel.workers", workers)
+               , ("parallel.interactions", count total)
+               , ("parallel.main-interactions", count (head rules))
+               , ("parallel.steals", sum steals) ]
+            ++ [ ("parallel." ++ name, k) | (name, k) <- Map.toList total ])
+
+evalStats :: (HOAS.Primitive a) => Config -> Exp a -> IO (a, Stats.Stats)
+evalStats cfg t = do
+    cores <- if null (cfgCores cfg) then (:[]) <$> getNumCapabilities else return (cfgCores cfg)
+    runs <- forM cores $ \c -> do
+        setNumCapabilities c
+        start <- getMonotonicTimeNSec
+        (x, stats) <- run cfg (c - 1) t
+        _ <- evaluate (length (show x))
+        end <- getMonotonicTimeNSec
+        return (c, x, stats, fromIntegral ((end - start) `div` 1000) :: Int)
+    let (_, x, stats, _) = last runs
+        (_, _, _, base) = head runs
+    return (x, stats ++ concat [ [ ("parallel.wall-us." ++ show c, us)
+                                 , ("parallel.speedup-percent." ++ show c, base * 100 `div` max 1 us) ]
+                               | (c, _, _, us) <- runs ])
+
+eval :: (HOAS.Primitive a) => Config -> Exp a -> IO a
+eval cfg = fmap fst . evalStats cfg
@@ -0,0 +1,23 @@
+{-# LANGUAGE MultiParamTypeClasses, FunctionalDependencies #-}
+
+-- The interface Thyer needs from its heap: mutable references that can be
+-- linked, so that after link old new, reading old gives what new holds.  A
+-- store s hands out references r; it also keeps whatever counters the backend
+-- finds interesting.  resolve gives the reference a chain of links ends at,
+-- or Nothing if the reference is not linked anywhere.
+--
+-- Backends: IORefRef (link copies), IndirRef (link leaves an indirection) and
+-- UnionFindRef (link is a union in a union-find forest).
+
+module Ref (Store(..)) where
+
+import Prelude hiding (read)
+import qualified Stats
+
+class Store s r | s -> r, r -> s where
+    new   :: s a -> a -> IO (r a)
+    read  :: s a -> r a -> IO a
+    write :: s a -> r a -> a -> IO ()
+    link  :: s a -> r a -> r a -> IO ()
+    resolve :: s a -> r a -> IO (Maybe (r a))
+    stats :: s a -> IO Stats.Stats
@@ -0,0 +1,39 @@
+-- Named event counters, used by the engines to report how much work they
+-- did.  Main prints them to stderr when given --stats.
+
+module Stats
+    ( Stats, Counter, newCounter, tick, tickBy, record, readCounter, readCounters, report )
+where
+
+import Data.IORef
+import System.IO (hPutStrLn, stderr)
+
+type Stats = [(String, Int)]
+
+newtype Counter = Counter (IORef Int)
+
+newCounter :: IO Counter
+newCounter = fmap Counter (newIORef 0)
+
+tick :: Counter -> IO ()
+tick = tickBy 1
+
+tickBy :: Int -> Counter -> IO ()
+tickBy n (Counter ref) = do
+    x <- readIORef ref
+    writeIORef ref $! x + n
+
+-- record keeps the largest value it has been given, for high-water marks.
+record :: Counter -> Int -> IO ()
+record (Counter ref) n = do
+    x <- readIORef ref
+    if n > x then writeIORef ref n else return ()
+
+readCounter :: Counter -> IO Int
+readCounter (Counter ref) = readIORef ref
+
+readCounters :: [(String, Counter)] -> IO Stats
+readCounters = mapM (\(name, c) -> fmap ((,) name) (readCounter c))
+
+report :: Stats -> IO ()
+report = mapM_ (\(name, n) -> hPutStrLn stderr (name ++ ": " ++ show n))
@@ -1,125 +1,593 @@
+{-# LANGUAGE FlexibleContexts #-}
 {-# OPTIONS_GHC -funbox-strict-fields #-}
 
 -- An implementation of a Thyer lazy specializer. From:
 -- Lazy Specialization
 -- by Michael Jonathan Thyer (1999).
 
--- Memoizing substitutions not implemented.
+-- Substitutions are memoized on (body, var, arg, shift), which gives Thyer's
+-- complete laziness: pushing the same substitution through the same node
+-- twice yields the same, shared, result.
 
-module Thyer (eval) where
+-- The heap is any Ref.Store, chosen at run time through cfgBackend.
+
+-- residualize keeps the specialized graph instead of only its value: it
+-- normalizes under lambdas as far as it safely can and reads the graph back
+-- as a term, a first Futamura projection of sorts.
+
+-- compact tidies the heap between reductions: see below.  Set cfgCompactEvery
+-- to have reduction run it every so many allocations.
+
+module Thyer (Config(..), Backend(..), defaultConfig, eval, evalStats, residualize) where
 
 import qualified Depth
+import qualified DeBruijn
 import qualified HOAS
-import qualified IORefRef as Ref
+import qualified Ref
+import qualified IORefRef
+import qualified IndirRef
+import qualified UnionFindRef
+import qualified Stats
+import qualified DepthSet
+import DepthSet (DepthSet)
+import qualified Data.Map as Map
+import qualified Data.IntMap as IntMap
+import qualified Data.IntSet as IntSet
+import Data.IORef
+import Data.List (partition)
+import Data.Maybe (fromMaybe, isJust, isNothing)
 import Control.Applicative
-import Control.Monad ((<=<))
+import Control.Monad ((<=<), when, forM)
 
 data Blocked
     = Blocked
     | Unblocked
     deriving (Eq)
 
-type NodeRef a = Ref.Ref (Node a)
+type NodeRef r a = r (Node r a)
 
-data Node a = Node {
+data Node r a = Node {
+    nodeId      :: !Int,
     nodeBlocked :: !Blocked,
     nodeDepth   :: !Int,
-    nodeData    :: !(NodeData a)
+    nodeFree    :: !DepthSet,      -- depths of the free variables
+    nodeData    :: !(NodeData r a)
   }
 
-data NodeData a
-    = Lambda !(NodeRef a)
-    | Apply  !(NodeRef a) !(NodeRef a)
-    | Subst  !(NodeRef a) !Int !(NodeRef a) !Int   -- body var arg shift
+data NodeData r a
+    = Lambda !(NodeRef r a)
+    | Apply  !(NodeRef r a) !(NodeRef r a)
+    | Subst  !(NodeRef r a) !Int !(NodeRef r a) !Int   -- body var arg shift
     | Var
     | Prim   a
 
+data Backend
+    = IORefBackend
+    | IndirBackend
+    | UnionFindBackend
+
+data Config = Config {
+    cfgMemo         :: Bool,        -- share substitutions through the memo table
+    cfgBackend      :: Backend,
+    cfgCompactEvery :: Maybe Int    -- allocations between compactions
+  }
+
+defaultConfig :: Config
+defaultConfig = Config { cfgMemo = True, cfgBackend = IORefBackend, cfgCompactEvery = Nothing }
+
+-- Substitutions are memoized on body, var, arg, shift.  Nodes are identified
+-- by their nodeId, which is kept by Ref.write and travels with Ref.link, so a
+-- ref always carries the id of a node equivalent to what it holds.
+type SubstKey = (Int, Int, Int, Int)
+
+data Heap s r a = Heap {
+    heapStore    :: s (Node r a),
+    heapConfig   :: Config,
+    heapNextId   :: IORef Int,
+    heapMemo     :: IORef (Map.Map SubstKey (NodeRef r a)),
+    heapAllocs   :: Stats.Counter,
+    heapMemoHits :: Stats.Counter,
+    heapMaxStack :: Stats.Counter,
+    heapPruned   :: Stats.Counter,
+    heapRoots    :: IORef [NodeRef r a],    -- kept alive by compact, besides reduce's own
+    heapCompact  :: Compaction
+  }
+
+-- What compact has done so far.
+data Compaction = Compaction {
+    compactLast      :: IORef Int,          -- heapAllocs at the last run
+    compactRuns      :: Stats.Counter,
+    compactShortcuts :: Stats.Counter,
+    compactDropped   :: Stats.Counter,
+    compactCensus    :: IORef Stats.Stats   -- live nodes before and after the last run
+  }
+
+newHeap :: s (Node r a) -> Config -> IO (Heap s r a)
+newHeap store cfg = Heap store cfg <$> newIORef 0 <*> newIORef Map.empty <*> Stats.newCounter <*> Stats.newCounter
+                    <*> Stats.newCounter <*> Stats.newCounter <*> newIORef [] <*> compaction
+    where
+    compaction = Compaction <$> newIORef 0 <*> Stats.newCounter <*> Stats.newCounter <*> Stats.newCounter
+                            <*> newIORef []
+
+heapStats :: (Ref.Store s r) => Heap s r a -> IO Stats.Stats
+heapStats heap = do
+    counts <- Stats.readCounters [ ("thyer.nodes", heapAllocs heap)
+                                 , ("thyer.memo-hits", heapMemoHits heap)
+                                 , ("thyer.max-stack", heapMaxStack heap)
+                                 , ("thyer.subst-pruned", heapPruned heap) ]
+    entries <- Map.size <$> readIORef (heapMemo heap)
+    let c = heapCompact heap
+    runs <- Stats.readCounter (compactRuns c)
+    compacts <- if runs == 0 then return [] else do
+        cs <- Stats.readCounters [ ("compact.runs", compactRuns c)
+                                 , ("compact.shortcuts", compactShortcuts c)
+                                 , ("compact.memo-dropped", compactDropped c) ]
+        (cs ++) <$> readIORef (compactCensus c)
+    refstats <- Ref.stats (heapStore heap)
+    return $ counts ++ [ ("thyer.memo-entries", entries) ] ++ compacts ++ refstats
+
+readRef :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> IO (Node r a)
+readRef = Ref.read . heapStore
+
+writeRef :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> Node r a -> IO ()
+writeRef = Ref.write . heapStore
+
+linkRef :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> NodeRef r a -> IO ()
+linkRef = Ref.link . heapStore
+
+-- resolveRef skips any links between ref and the node it stands for.
+resolveRef :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> IO (NodeRef r a)
+resolveRef heap ref = fromMaybe ref <$> Ref.resolve (heapStore heap) ref
+
+freeOf :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> IO DepthSet
+freeOf heap ref = nodeFree <$> readRef heap ref
+
+newNode :: (Ref.Store s r) => Heap s r a -> Blocked -> Int -> DepthSet -> NodeData r a -> IO (NodeRef r a)
+newNode heap blocked depth free dat = do
+    ident <- readIORef (heapNextId heap)
+    writeIORef (heapNextId heap) $! ident + 1
+    Stats.tick (heapAllocs heap)
+    Ref.new (heapStore heap) (Node ident blocked depth free dat)
+
+-- newSubst builds a suspended substitution node, or returns the one already
+-- built for the same substitution if memoization is on.
+newSubst :: (Ref.Store s r) => Heap s r a -> Int -> NodeRef r a -> Int -> NodeRef r a -> Int -> IO (NodeRef r a)
+newSubst heap depth body bind arg shift = do
+    bodynode <- readRef heap body
+    argnode <- readRef heap arg
+    let free = DepthSet.substitute bind shift (nodeFree bodynode) (nodeFree argnode)
+        build = newNode heap Unblocked depth free (Subst body bind arg shift)
+        key = (nodeId bodynode, bind, nodeId argnode, shift)
+    if not (cfgMemo (heapConfig heap)) then build else do
+    memo <- readIORef (heapMemo heap)
+    case Map.lookup key memo of
+        Just ref -> do
+            Stats.tick (heapMemoHits heap)
+            return ref
+        Nothing -> do
+            ref <- build
+            writeIORef (heapMemo heap) $! Map.insert key ref memo
+            return ref
+
+-- Continuation frames for reduce.  Each says what to do with the whnf of the
+-- node reduce was working on when the frame was pushed.
+data Frame r a
+    = ApplyFun  !(NodeRef r a) !(Node r a) !(NodeRef r a)  -- apply node, arg
+    | ApplyPrim !(NodeRef r a) !(Node r a) a               -- apply node, function
+    | SubstBody !(NodeRef r a) !(NodeRef r a) !Int !(NodeRef r a) !Int
+    | LinkTo    !(NodeRef r a) !(NodeRef r a)              -- redex, its memoized subst
+
+frameRefs :: Frame r a -> [NodeRef r a]
+frameRefs (ApplyFun ref _ arg)          = [ref, arg]
+frameRefs (ApplyPrim ref _ _)           = [ref]
+frameRefs (SubstBody ref body _ arg _)  = [ref, body, arg]
+frameRefs (LinkTo ref substref)         = [ref, substref]
+
 -- reduce reduces its argument to whnf *destructively*.  It returns the reduced 
 -- node for convenience.  reduce x = reduce x >> Ref.read x.
-reduce :: (HOAS.Primitive a) => NodeRef a -> IO (Node a)
-reduce ref = do
-    node <- Ref.read ref
-    if nodeBlocked node == Blocked then return node else do
-    case nodeData node of
-        Apply f arg -> do
-            fnode <- reduce f
-            case nodeData fnode of
-                Lambda body -> do
-                    let bind = nodeDepth fnode + 1
-
-                        -- shift is the amount by which the depths of f's nodes are expected
-                        -- to change.
-                        shift = nodeDepth node - bind
-
-                        -- This is (nodeDepth fnode) instead of (nodeDepth node) in Thyer's
-                        -- paper. It is somewhat irrelevant since we only check depths when we
-                        -- are substituting through a node, and we never subsitute through a 
-                        -- subst node, but I believe this makes more sense.
-                        node' = Node Unblocked (nodeDepth node) (Subst body bind arg shift)
-                    Ref.write ref node'
-                    reduce ref
-                Prim p -> do
-                    argnode <- reduce arg
-                    case nodeData argnode of
-                        Prim p'   -> sideEffect (Ref.write ref) (Node Blocked 0 (Prim $ p `HOAS.apply` p'))
-                        Apply {}  -> blocked
-                        Var {}    -> blocked
-                        Lambda {} -> fail "Can't apply primitive to lambda"
-                        Subst {}  -> fail "Bug - reduced expression ended up a subst"
-                _ -> blocked
-        Subst body var arg shift -> do
-            -- This is the code that has the specializing effect.  We *reduce*
-            -- the body, including application nodes, before substituting into it.  
-            -- A simple lazy evaluator would just push down the substitution through
-            -- any type of node, including applications.  cf. Thyer p. 122.
-            reduce body
-            Ref.link ref =<< subst body var arg shift
-            reduce ref
-        _ -> blocked
+reduce :: (HOAS.Primitive a, Ref.Store s r) => Heap s r a -> NodeRef r a -> IO (Node r a)
+reduce heap ref = do
+    (result, _) <- reduceFor heap maxBound ref
+    maybe (fail "Bug - reduction ran out of fuel") return result
+
+-- reduceFor is reduce giving up after fuel steps, in which case it returns
+-- Nothing.  Every step leaves the graph standing for the same term, so giving
+-- up leaves it partially but consistently reduced.  It also returns the fuel
+-- it did not use.
+--
+-- The continuation is kept as an explicit stack of frames rather than on the
+-- Haskell stack, which would otherwise grow with the length of the spine and
+-- with the tower level.  The deepest stack reached is reported as
+-- thyer.max-stack.
+--
+-- With cfgCompactEvery set, it compacts the heap as it goes, keeping what the
+-- frames refer to.
+reduceFor :: (HOAS.Primitive a, Ref.Store s r) => Heap s r a -> Int -> NodeRef r a -> IO (Maybe (Node r a), Int)
+reduceFor heap fuel0 = enter fuel0 0 []
     where
-    blocked = do
-        node <- Ref.read ref
-        sideEffect (Ref.write ref) $! node { nodeBlocked = Blocked }
+    enter fuel depth stack ref = do
+        node <- readRef heap ref
+        if nodeBlocked node == Blocked then continue fuel depth stack node else do
+        if fuel <= 0 then return (Nothing, 0) else do
+        let fuel' = fuel - 1
+        case nodeData node of
+            Apply f arg ->
+                push fuel' depth stack (ApplyFun ref node arg) f
+            Subst body var arg shift ->
+                -- This is the code that has the specializing effect.  We *reduce*
+                -- the body, including application nodes, before substituting into it.  
+                -- A simple lazy evaluator would just push down the substitution through
+                -- any type of node, including applications.  cf. Thyer p. 122.
+                push fuel' depth stack (SubstBody ref body var arg shift) body
+            _ -> blocked fuel' depth stack ref
+
+    push fuel depth stack frame ref = do
+        Stats.record (heapMaxStack heap) (depth + 1)
+        maybeCompact heap (ref : concatMap frameRefs (frame : stack))
+        enter fuel (depth + 1) (frame : stack) ref
+
+    continue fuel _ [] node = return (Just node, fuel)
+    continue fuel depth (frame : stack) node = resume fuel (depth - 1) stack frame node
+
+    resume fuel depth stack (ApplyFun ref node arg) fnode = case nodeData fnode of
+        Lambda body -> do
+            let bind = nodeDepth fnode + 1
 
-sideEffect :: (a -> IO ()) -> a -> IO a
-sideEffect f x = f x >> return x
+                -- shift is the amount by which the depths of f's nodes are expected
+                -- to change.
+                shift = nodeDepth node - bind
+
+            -- The depth is (nodeDepth fnode) instead of (nodeDepth node) in Thyer's
+            -- paper. It is somewhat irrelevant since we only check depths when we
+            -- are substituting through a node, and we never subsitute through a
+            -- subst node, but I believe this makes more sense.
+            if cfgMemo (heapConfig heap)
+                then do
+                    -- Go through the memo table, so that every application of
+                    -- this lambda to this argument shares one reduction.
+                    substref <- newSubst heap (nodeDepth node) body bind arg shift
+                    push fuel depth stack (LinkTo ref substref) substref
+                else do
+                    writeRef heap ref node { nodeData = Subst body bind arg shift }
+                    enter fuel depth stack ref
+        Prim p -> push fuel depth stack (ApplyPrim ref node p) arg
+        _ -> blocked fuel depth stack ref
+    resume fuel depth stack (ApplyPrim ref node p) argnode = case nodeData argnode of
+        Prim p'   -> do
+            let node' = Node (nodeId node) Blocked 0 DepthSet.empty (Prim $ p `HOAS.apply` p')
+            writeRef heap ref node'
+            continue fuel depth stack node'
+        Apply {}  -> blocked fuel depth stack ref
+        Var {}    -> blocked fuel depth stack ref
+        Lambda {} -> fail "Can't apply primitive to lambda"
+        Subst {}  -> fail "Bug - reduced expression ended up a subst"
+    resume fuel depth stack (SubstBody ref body var arg shift) _ = do
+        linkRef heap ref =<< subst heap body var arg shift
+        enter fuel depth stack ref
+    resume fuel depth stack (LinkTo ref substref) substnode = do
+        linkRef heap ref substref
+        continue fuel depth stack substnode
+
+    blocked fuel depth stack ref = do
+        node <- readRef heap ref
+        let node' = node { nodeBlocked = Blocked }
+        writeRef heap ref node'
+        continue fuel depth stack node'
 
 -- subst returns body with the variable at depth bind substituted for arg.  It
 -- does not modify its arguments.
-subst :: NodeRef a -> Int -> NodeRef a -> Int -> IO (NodeRef a)
-subst body bind arg shift = do  
-    bodynode <- Ref.read body
-    -- if the depth of the body is less than the depth of the variable we are 
-    -- substituting, the variable cannot possibly occur in the body, so just 
+subst :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> Int -> NodeRef r a -> Int -> IO (NodeRef r a)
+subst heap body bind arg shift = do
+    bodynode <- readRef heap body
+    -- if the depth of the body is less than the depth of the variable we are
+    -- substituting, the variable cannot possibly occur in the body, so just
     -- dissolve away.
     if nodeDepth bodynode < bind then return body else do
-    
+
+    -- The same goes if the variable is not free in the body, as long as
+    -- nothing in it needs renumbering: either the shift is zero or all of its
+    -- free variables are bound outside the substitution.  Depth is an upper
+    -- bound on the free variables, so this subsumes the test above, which is
+    -- just cheaper.
+    let free = nodeFree bodynode
+    if not (DepthSet.member bind free) && (shift == 0 || DepthSet.allBelow bind free)
+        then Stats.tick (heapPruned heap) >> return body else do
+
     let newdepth = nodeDepth bodynode + shift
     case nodeData bodynode of
         Var | nodeDepth bodynode == bind -> return arg
-            | otherwise                  -> Ref.new (Node Blocked newdepth Var)
+            | otherwise                  -> newNode heap Blocked newdepth (DepthSet.singleton newdepth) Var
         Lambda body -> do
-            substbody <- Ref.new (Node Unblocked (newdepth+1) (Subst body bind arg shift))
-            Ref.new (Node Unblocked newdepth (Lambda substbody))
+            substbody <- newSubst heap (newdepth+1) body bind arg shift
+            free' <- DepthSet.delete (newdepth+1) <$> freeOf heap substbody
+            newNode heap Unblocked newdepth free' (Lambda substbody)
         Apply f x -> do
-            f' <- Ref.new (Node Unblocked newdepth (Subst f bind arg shift)) 
-            x' <- Ref.new (Node Unblocked newdepth (Subst x bind arg shift))
-            Ref.new (Node Unblocked newdepth (Apply f' x'))
+            f' <- newSubst heap newdepth f bind arg shift
+            x' <- newSubst heap newdepth x bind arg shift
+            free' <- DepthSet.union <$> freeOf heap f' <*> freeOf heap x'
+            newNode heap Unblocked newdepth free' (Apply f' x')
         _ -> return body
 
-fromDepth :: Depth.ExpNode a -> IO (NodeRef a)
-fromDepth (d, n) = case n of
-    Depth.Lambda body -> Ref.new . Node Unblocked d . Lambda =<< fromDepth body
-    Depth.Apply f x   -> Ref.new =<< Node Unblocked d <$> liftA2 Apply (fromDepth f) (fromDepth x)
-    Depth.Var         -> Ref.new (Node Blocked d Var)
-    Depth.Prim x      -> Ref.new . Node Blocked d . Prim $ x
+fromDepth :: (Ref.Store s r) => Heap s r a -> Depth.ExpNode a -> IO (NodeRef r a)
+fromDepth heap (d, n) = case n of
+    Depth.Lambda body -> do
+        body' <- fromDepth heap body
+        free <- DepthSet.delete (d+1) <$> freeOf heap body'
+        newNode heap Unblocked d free (Lambda body')
+    Depth.Apply f x -> do
+        f' <- fromDepth heap f
+        x' <- fromDepth heap x
+        free <- DepthSet.union <$> freeOf heap f' <*> freeOf heap x'
+        newNode heap Unblocked d free (Apply f' x')
+    Depth.Var    -> newNode heap Blocked d (DepthSet.singleton d) Var
+    Depth.Prim x -> newNode heap Blocked d DepthSet.empty (Prim x)
 
-getValue :: (HOAS.Primitive a) => NodeRef a -> IO a
-getValue ref = do
-    refnode <- reduce ref
+getValue :: (HOAS.Primitive a, Ref.Store s r) => Heap s r a -> NodeRef r a -> IO a
+getValue heap ref = do
+    refnode <- reduce heap ref
     case nodeData refnode of
         Prim x -> return x
         _ -> fail "Not a value"
 
+evalStats :: (HOAS.Primitive a) => Config -> Depth.Depth a -> IO (a, Stats.Stats)
+evalStats cfg = case cfgBackend cfg of
+    IORefBackend     -> evalWith IORefRef.newStore cfg
+    IndirBackend     -> evalWith IndirRef.newStore cfg
+    UnionFindBackend -> evalWith UnionFindRef.newStore cfg
+
+evalWith :: (HOAS.Primitive a, Ref.Store s r)
+         => IO (s (Node r a)) -> Config -> Depth.Depth a -> IO (a, Stats.Stats)
+evalWith newStore cfg t = do
+    store <- newStore
+    heap <- newHeap store cfg
+    x <- getValue heap <=< fromDepth heap . Depth.getDepth $ t
+    stats <- heapStats heap
+    return (x, stats)
+
 eval :: (HOAS.Primitive a) => Depth.Depth a -> IO a
-eval = getValue <=< fromDepth . Depth.getDepth
+eval = fmap fst . evalStats defaultConfig
+
+children :: NodeData r a -> [NodeRef r a]
+children (Lambda body)          = [body]
+children (Apply f x)            = [f, x]
+children (Subst body _ arg _)   = [body, arg]
+children _                      = []
+
+-- withChildren replaces the children of a node, in the order children gives.
+withChildren :: NodeData r a -> [NodeRef r a] -> NodeData r a
+withChildren (Lambda _) [body]                  = Lambda body
+withChildren (Apply _ _) [f, x]                 = Apply f x
+withChildren (Subst _ var _ shift) [body, arg]  = Subst body var arg shift
+withChildren dat _                              = dat
+
+-- compact tidies the heap, keeping roots, heapRoots and whatever they reach.
+-- A reduced Subst node stays behind as a link to its result, and the parents
+-- that were built pointing at it keep it, and any links after it, reachable.
+-- compact points every live node straight at the representatives of its
+-- children, so that nothing holds on to those links any more; how much that
+-- frees depends on the backend (IORefRef copies rather than links, so there
+-- is nothing to skip).
+--
+-- It also drops the memo entries that can no longer be hit.  A substitution
+-- is only ever pushed through a node that is live, into an argument that is
+-- live, so an entry whose body or argument is dead is dead itself, and with
+-- it the result it keeps alive.  Entries for live substitutions keep their
+-- results, and what those reach, alive in turn.
+--
+-- The live nodes are counted by kind before and after, as compact.before.*
+-- and compact.after.*.
+compact :: (Ref.Store s r) => Heap s r a -> [NodeRef r a] -> IO ()
+compact heap roots0 = do
+    let c = heapCompact heap
+    Stats.tick (compactRuns c)
+    extra <- readIORef (heapRoots heap)
+    roots <- mapM (resolveRef heap) (roots0 ++ extra)
+    memo <- mapM (resolveRef heap) =<< readIORef (heapMemo heap)
+    before <- census heap (roots ++ Map.elems memo)
+    live <- mark heap IntSet.empty roots
+    kept <- settle live [] (Map.toList memo)
+    Stats.tickBy (Map.size memo - length kept) (compactDropped c)
+    writeIORef (heapMemo heap) $! Map.fromList kept
+    after <- census heap (roots ++ map snd kept)
+    writeIORef (compactCensus c) $ [ ("compact.before." ++ k, n) | (k, n) <- before ]
+                                ++ [ ("compact.after." ++ k, n) | (k, n) <- after ]
+    where
+    settle live kept entries = do
+        let hit ((body, _, arg, _), _) = IntSet.member body live && IntSet.member arg live
+            (hits, misses) = partition hit entries
+        if null hits then return kept else do
+        live' <- mark heap live (map snd hits)
+        settle live' (hits ++ kept) misses
+
+maybeCompact :: (Ref.Store s r) => Heap s r a -> [NodeRef r a] -> IO ()
+maybeCompact heap roots = case cfgCompactEvery (heapConfig heap) of
+    Nothing -> return ()
+    Just every -> do
+        allocs <- Stats.readCounter (heapAllocs heap)
+        lastrun <- readIORef (compactLast (heapCompact heap))
+        when (allocs - lastrun >= every) $ do
+            writeIORef (compactLast (heapCompact heap)) allocs
+            compact heap roots
+
+-- mark adds the ids of the nodes reachable from refs to seen, short-circuiting
+-- their children on the way.  refs must already be resolved.
+mark :: (Ref.Store s r) => Heap s r a -> IntSet.IntSet -> [NodeRef r a] -> IO IntSet.IntSet
+mark heap = go
+    where
+    go seen [] = return seen
+    go seen (ref : refs) = do
+        node <- readRef heap ref
+        if IntSet.member (nodeId node) seen then go seen refs else do
+        let kids = children (nodeData node)
+        resolved <- mapM (Ref.resolve (heapStore heap)) kids
+        node' <- if all isNothing resolved then return node else do
+            Stats.tickBy (length (filter isJust resolved)) (compactShortcuts (heapCompact heap))
+            let node' = node { nodeData = withChildren (nodeData node) (zipWith fromMaybe kids resolved) }
+            writeRef heap ref node'
+            return node'
+        go (IntSet.insert (nodeId node) seen) (children (nodeData node') ++ refs)
+
+-- census counts the nodes reachable from refs by kind.
+census :: (Ref.Store s r) => Heap s r a -> [NodeRef r a] -> IO Stats.Stats
+census heap refs0 = do
+    counts <- go IntSet.empty Map.empty refs0
+    return [ (kind, Map.findWithDefault 0 kind counts) | kind <- ["lambda", "apply", "subst", "var", "prim"] ]
+    where
+    go _ counts [] = return counts
+    go seen counts (ref : refs) = do
+        node <- readRef heap ref
+        if IntSet.member (nodeId node) seen then go seen counts refs else do
+        let counts' = Map.insertWith (+) (kindOf (nodeData node)) (1::Int) counts
+        go (IntSet.insert (nodeId node) seen) counts' (children (nodeData node) ++ refs)
+    kindOf (Lambda _)      = "lambda"
+    kindOf (Apply _ _)     = "apply"
+    kindOf (Subst _ _ _ _) = "subst"
+    kindOf Var             = "var"
+    kindOf (Prim _)        = "prim"
+
+-- normalize reduces every node reachable from root to whnf, giving each node
+-- at most fuel steps and the whole traversal at most budget.  A node that
+-- does not reach whnf in time, such as a diverging argument that is never
+-- used, is left as it is.  Returns how many nodes were left unfinished.
+normalize :: (HOAS.Primitive a, Ref.Store s r) => Heap s r a -> Int -> Int -> NodeRef r a -> IO Int
+normalize heap fuel budget root = go IntSet.empty budget 0 [root]
+    where
+    go _ _ unfinished [] = return unfinished
+    go seen left unfinished (ref : refs) = do
+        node <- readRef heap ref
+        if IntSet.member (nodeId node) seen then go seen left unfinished refs else do
+        let allowance = min fuel left
+        (result, spare) <- reduceFor heap allowance ref
+        node' <- readRef heap ref
+        let left'       = left - (allowance - spare)
+            unfinished' = maybe (unfinished + 1) (const unfinished) result
+            seen'       = IntSet.insert (nodeId node) (IntSet.insert (nodeId node') seen)
+        go seen' left' unfinished' (children (nodeData node') ++ refs)
+
+-- sharing counts how many edges lead to each node reachable from root, and
+-- lists those nodes in postorder.  It also gives the nodes that a path from
+-- root comes back to: the memo table can tie a knot, as it does for fix, and
+-- every cycle goes through one of them.
+sharing :: (Ref.Store s r) => Heap s r a -> NodeRef r a -> IO (IntMap.IntMap Int, [(NodeRef r a, Node r a)], IntSet.IntSet)
+sharing heap root = do
+    counts <- newIORef IntMap.empty
+    order <- newIORef []
+    path <- newIORef IntSet.empty
+    loops <- newIORef IntSet.empty
+    let visit ref = do
+            node <- readRef heap ref
+            seen <- IntMap.member (nodeId node) <$> readIORef counts
+            back <- IntSet.member (nodeId node) <$> readIORef path
+            modifyIORef counts (IntMap.insertWith (+) (nodeId node) 1)
+            when back $ modifyIORef loops (IntSet.insert (nodeId node))
+            when (not seen) $ do
+                modifyIORef path (IntSet.insert (nodeId node))
+                mapM_ visit (children (nodeData node))
+                modifyIORef path (IntSet.delete (nodeId node))
+                modifyIORef order ((ref, node) :)
+    visit root
+    (,,) <$> readIORef counts <*> (reverse <$> readIORef order) <*> readIORef loops
+
+-- Where readback is.  Lets maps shared nodes to the position of their let,
+-- the first bound of them being in scope; loops are the nodes a path comes
+-- back to, and fixes maps those being read back around here to the position
+-- of their fixpoint's binder.
+data Scope = Scope {
+    scopeLets  :: IntMap.IntMap Int,
+    scopeBound :: !Int,
+    scopeLoops :: IntSet.IntSet,
+    scopeFixes :: IntMap.IntMap Int
+  }
+
+-- readback turns the graph under ref into a term.  ctx is the number of
+-- binders around it, and names maps the depth of a variable to the position
+-- of its binder.
+--
+-- A Subst node reads back as a redex: inside its body, depths above the
+-- variable are the result's depths less the shift.
+readback :: (Ref.Store s r) => Heap s r a -> Scope -> Int -> (Int -> Int) -> NodeRef r a -> IO (DeBruijn.Exp a)
+readback heap scope ctx names ref = do
+    node <- readRef heap ref
+    case (IntMap.lookup (nodeId node) (scopeFixes scope), IntMap.lookup (nodeId node) (scopeLets scope)) of
+        (Just pos, _)                          -> return (DeBruijn.EVar (ctx - 1 - pos))
+        (_, Just pos) | pos < scopeBound scope -> return (DeBruijn.EVar (ctx - 1 - pos))
+        _                                      -> readbackNode heap scope ctx names node
+
+-- Lets are not recursive, so a node a path comes back to reads back as the
+-- fixpoint of a lambda, whose variable stands for the node inside it.
+readbackNode :: (Ref.Store s r) => Heap s r a -> Scope -> Int -> (Int -> Int) -> Node r a -> IO (DeBruijn.Exp a)
+readbackNode heap scope ctx names node
+    | IntSet.member (nodeId node) (scopeLoops scope) = do
+        let scope' = scope { scopeFixes = IntMap.insert (nodeId node) ctx (scopeFixes scope) }
+        DeBruijn.EApp fixpoint . DeBruijn.ELam <$> readbackData heap scope' (ctx+1) names node
+    | otherwise = readbackData heap scope ctx names node
+
+readbackData :: (Ref.Store s r) => Heap s r a -> Scope -> Int -> (Int -> Int) -> Node r a -> IO (DeBruijn.Exp a)
+readbackData heap scope ctx names node = case nodeData node of
+    Var    -> return (DeBruijn.EVar (ctx - 1 - names (nodeDepth node)))
+    Prim p -> return (DeBruijn.EPrim p)
+    Lambda body -> do
+        let names' d | d == nodeDepth node + 1 = ctx
+                     | otherwise               = names d
+        DeBruijn.ELam <$> readback heap scope (ctx+1) names' body
+    Apply f x -> DeBruijn.EApp <$> readback heap scope ctx names f <*> readback heap scope ctx names x
+    Subst body bind arg shift -> do
+        let names' d | d == bind = ctx
+                     | d > bind  = names (d + shift)
+                     | otherwise = names d
+        body' <- readback heap scope (ctx+1) names' body
+        arg' <- readback heap scope ctx names arg
+        return (DeBruijn.EApp (DeBruijn.ELam body') arg')
+
+-- \f -> (\x -> f (x x)) (\x -> f (x x))
+fixpoint :: DeBruijn.Exp a
+fixpoint = DeBruijn.ELam (DeBruijn.EApp self self)
+    where
+    self = DeBruijn.ELam (DeBruijn.EApp (DeBruijn.EVar 1) (DeBruijn.EApp (DeBruijn.EVar 0) (DeBruijn.EVar 0)))
+
+-- Closed nodes that are reached more than once are read back as lets around
+-- the whole term, each in the scope of those before it.  Open ones are
+-- duplicated, since a let for them could only go where all of their variables
+-- are bound.
+residualize :: (HOAS.Primitive a) => Config -> Int -> Depth.Depth a -> IO (DeBruijn.Exp a, Stats.Stats)
+residualize cfg fuel t = case cfgBackend cfg of
+    IORefBackend     -> residualizeWith IORefRef.newStore cfg fuel t
+    IndirBackend     -> residualizeWith IndirRef.newStore cfg fuel t
+    UnionFindBackend -> residualizeWith UnionFindRef.newStore cfg fuel t
+
+residualizeWith :: (HOAS.Primitive a, Ref.Store s r)
+                => IO (s (Node r a)) -> Config -> Int -> Depth.Depth a -> IO (DeBruijn.Exp a, Stats.Stats)
+residualizeWith newStore cfg fuel t = do
+    store <- newStore
+    heap <- newHeap store cfg
+    root <- fromDepth heap (Depth.getDepth t)
+    writeIORef (heapRoots heap) [root]
+    unfinished <- normalize heap fuel (residualBudget fuel) root
+    when (isJust (cfgCompactEvery cfg)) $ compact heap []
+    (counts, order, loops) <- sharing heap root
+    let shared = [ node | (_, node) <- order
+                        , IntMap.findWithDefault 0 (nodeId node) counts > 1
+                        , DepthSet.null (nodeFree node)
+                        , compound (nodeData node) ]
+        lets = IntMap.fromList (zip (map nodeId shared) [0..])
+        scope bound = Scope lets bound loops IntMap.empty
+        unbound d = error $ "Thyer.residualize: unbound depth " ++ show d
+    defs <- forM (zip [0..] shared) $ \(pos, node) -> readbackNode heap (scope pos) pos unbound node
+    body <- readback heap (scope (length shared)) (length shared) unbound root
+    let residual = foldr (\defn e -> DeBruijn.EApp (DeBruijn.ELam e) defn) body defs
+    stats <- heapStats heap
+    return (residual, stats ++ [ ("residual.size", DeBruijn.size residual)
+                               , ("residual.lets", length shared)
+                               , ("residual.fixpoints", IntSet.size loops)
+                               , ("residual.unfinished", unfinished) ])
+    where
+    compound Var      = False
+    compound (Prim _) = False
+    compound _        = True
+
+-- What normalize may spend in all: a thousand nodes' worth of fuel, or as
+-- much as an Int holds.
+residualBudget :: Int -> Int
+residualBudget fuel
+    | fuel > maxBound `div` 1000 = maxBound
+    | otherwise                  = fuel * 1000
@@ -0,0 +1,257 @@
+-- Thyer's lazy specializer (see Thyer.hs) over a struct-of-arrays node store.
+-- Nodes are Int indices into unboxed columns for the tag, depth, blocked bit
+-- and children, so the graph is a handful of flat arrays rather than one heap
+-- object per node for the GC to trace.  Only primitive values are boxed, in a
+-- table of their own.
+--
+-- Ref.link is done the way IORefRef does it, by copying the target's columns
+-- over the old node.
+
+module ThyerArena (eval, evalStats) where
+
+import qualified Depth
+import qualified HOAS
+import qualified Column
+import qualified Stats
+import qualified Thyer
+import qualified Data.Map as Map
+import Data.IORef
+import Control.Applicative
+import Control.Monad (when, forM_)
+
+type NodeIx = Int
+
+tagLambda, tagApply, tagSubst, tagVar, tagPrim :: Int
+tagLambda = 0
+tagApply  = 1
+tagSubst  = 2
+tagVar    = 3
+tagPrim   = 4
+
+-- Lambda: child0 = body
+-- Apply:  child0 = f, child1 = arg
+-- Subst:  child0 = body, child1 = var, child2 = arg, child3 = shift
+-- Prim:   child0 = index into arenaPrims
+data Arena a = Arena {
+    arenaConfig    :: Thyer.Config,
+    arenaSize      :: IORef Int,
+    arenaCapacity  :: IORef Int,
+    arenaTag       :: Column.UColumn Int,
+    arenaDepth     :: Column.UColumn Int,
+    arenaBlocked   :: Column.UColumn Bool,
+    arenaChild0    :: Column.UColumn Int,
+    arenaChild1    :: Column.UColumn Int,
+    arenaChild2    :: Column.UColumn Int,
+    arenaChild3    :: Column.UColumn Int,
+    arenaPrims     :: Column.BColumn a,
+    arenaPrimCount :: IORef Int,
+    arenaMemo      :: IORef (Map.Map (Int, Int, Int, Int) NodeIx),
+    arenaMemoHits  :: Stats.Counter
+  }
+
+-- A decoded node, for case analysis.
+data View a
+    = Lambda !NodeIx
+    | Apply  !NodeIx !NodeIx
+    | Subst  !NodeIx !Int !NodeIx !Int
+    | Var
+    | Prim   a
+
+initialCapacity :: Int
+initialCapacity = 1024
+
+newArena :: Thyer.Config -> IO (Arena a)
+newArena cfg = Arena cfg
+    <$> newIORef 0 <*> newIORef initialCapacity
+    <*> col <*> col <*> Column.new initialCapacity
+    <*> col <*> col <*> col <*> col
+    <*> Column.new 64 <*> newIORef 0
+    <*> newIORef Map.empty <*> Stats.newCounter
+    where
+    col = Column.new initialCapacity
+
+intColumns :: Arena a -> [Column.UColumn Int]
+intColumns arena = [ arenaTag arena, arenaDepth arena
+                   , arenaChild0 arena, arenaChild1 arena, arenaChild2 arena, arenaChild3 arena ]
+
+arenaStats :: Arena a -> IO Stats.Stats
+arenaStats arena = do
+    size <- readIORef (arenaSize arena)
+    cap <- readIORef (arenaCapacity arena)
+    hits <- Stats.readCounter (arenaMemoHits arena)
+    entries <- Map.size <$> readIORef (arenaMemo arena)
+    return [ ("thyer-arena.nodes", size)
+           , ("thyer-arena.capacity", cap)
+           , ("thyer-arena.memo-hits", hits)
+           , ("thyer-arena.memo-entries", entries) ]
+
+setNode :: Arena a -> NodeIx -> Bool -> Int -> Int -> Int -> Int -> Int -> Int -> IO ()
+setNode arena ix blocked depth tag c0 c1 c2 c3 = do
+    Column.write (arenaTag arena) ix tag
+    Column.write (arenaDepth arena) ix depth
+    Column.write (arenaBlocked arena) ix blocked
+    Column.write (arenaChild0 arena) ix c0
+    Column.write (arenaChild1 arena) ix c1
+    Column.write (arenaChild2 arena) ix c2
+    Column.write (arenaChild3 arena) ix c3
+
+alloc :: Arena a -> Bool -> Int -> Int -> Int -> Int -> Int -> Int -> IO NodeIx
+alloc arena blocked depth tag c0 c1 c2 c3 = do
+    ix <- readIORef (arenaSize arena)
+    writeIORef (arenaSize arena) $! ix + 1
+    cap <- readIORef (arenaCapacity arena)
+    when (ix >= cap) $ do
+        let cap' = 2 * cap
+        forM_ (intColumns arena) $ \c -> Column.grow c (cap' - 1)
+        Column.grow (arenaBlocked arena) (cap' - 1)
+        writeIORef (arenaCapacity arena) cap'
+    setNode arena ix blocked depth tag c0 c1 c2 c3
+    return ix
+
+newPrim :: Arena a -> Int -> a -> IO NodeIx
+newPrim arena depth p = do
+    slot <- storePrim arena p
+    alloc arena True depth tagPrim slot 0 0 0
+
+storePrim :: Arena a -> a -> IO Int
+storePrim arena p = do
+    slot <- readIORef (arenaPrimCount arena)
+    writeIORef (arenaPrimCount arena) $! slot + 1
+    Column.grow (arenaPrims arena) slot
+    Column.write (arenaPrims arena) slot p
+    return slot
+
+view :: Arena a -> NodeIx -> IO (View a)
+view arena ix = do
+    tag <- Column.read (arenaTag arena) ix
+    let child c = Column.read (c arena) ix
+    case () of
+        _ | tag == tagLambda -> Lambda <$> child arenaChild0
+          | tag == tagApply  -> Apply <$> child arenaChild0 <*> child arenaChild1
+          | tag == tagSubst  -> Subst <$> child arenaChild0 <*> child arenaChild1
+                                      <*> child arenaChild2 <*> child arenaChild3
+          | tag == tagVar    -> return Var
+          | otherwise        -> Prim <$> (Column.read (arenaPrims arena) =<< child arenaChild0)
+
+depthOf :: Arena a -> NodeIx -> IO Int
+depthOf arena = Column.read (arenaDepth arena)
+
+-- link overwrites old with a copy of new.
+link :: Arena a -> NodeIx -> NodeIx -> IO ()
+link arena old new
+    | old == new = return ()
+    | otherwise = do
+        forM_ (intColumns arena) $ \c -> Column.write c old =<< Column.read c new
+        Column.write (arenaBlocked arena) old =<< Column.read (arenaBlocked arena) new
+
+newSubst :: Arena a -> Int -> NodeIx -> Int -> NodeIx -> Int -> IO NodeIx
+newSubst arena depth body bind arg shift
+    | Thyer.cfgMemo (arenaConfig arena) = do
+        let key = (body, bind, arg, shift)
+        memo <- readIORef (arenaMemo arena)
+        case Map.lookup key memo of
+            Just ix -> do
+                Stats.tick (arenaMemoHits arena)
+                return ix
+            Nothing -> do
+                ix <- build
+                writeIORef (arenaMemo arena) $! Map.insert key ix memo
+                return ix
+    | otherwise = build
+    where
+    build = alloc arena False depth tagSubst body bind arg shift
+
+-- reduce reduces the node at ix to whnf, destructively.
+reduce :: (HOAS.Primitive a) => Arena a -> NodeIx -> IO ()
+reduce arena ix = do
+    isBlocked <- Column.read (arenaBlocked arena) ix
+    if isBlocked then return () else do
+    node <- view arena ix
+    case node of
+        Apply f arg -> do
+            reduce arena f
+            fnode <- view arena f
+            case fnode of
+                Lambda body -> do
+                    fdepth <- depthOf arena f
+                    depth <- depthOf arena ix
+                    let bind = fdepth + 1
+                        shift = depth - bind
+                    if Thyer.cfgMemo (arenaConfig arena)
+                        then do
+                            s <- newSubst arena depth body bind arg shift
+                            reduce arena s
+                            link arena ix s
+                        else do
+                            setNode arena ix False depth tagSubst body bind arg shift
+                            reduce arena ix
+                Prim p -> do
+                    reduce arena arg
+                    argnode <- view arena arg
+                    case argnode of
+                        Prim p'   -> do
+                            slot <- storePrim arena (p `HOAS.apply` p')
+                            setNode arena ix True 0 tagPrim slot 0 0 0
+                        Apply {}  -> blocked
+                        Var {}    -> blocked
+                        Lambda {} -> fail "Can't apply primitive to lambda"
+                        Subst {}  -> fail "Bug - reduced expression ended up a subst"
+                _ -> blocked
+        Subst body var arg shift -> do
+            reduce arena body
+            link arena ix =<< subst arena body var arg shift
+            reduce arena ix
+        _ -> blocked
+    where
+    blocked = Column.write (arenaBlocked arena) ix True
+
+-- subst returns body with the variable at depth bind substituted for arg,
+-- without modifying its arguments.  See Thyer.subst.
+subst :: Arena a -> NodeIx -> Int -> NodeIx -> Int -> IO NodeIx
+subst arena body bind arg shift = do
+    depth <- depthOf arena body
+    if depth < bind then return body else do
+
+    let newdepth = depth + shift
+    node <- view arena body
+    case node of
+        Var | depth == bind -> return arg
+            | otherwise     -> alloc arena True newdepth tagVar 0 0 0 0
+        Lambda b -> do
+            b' <- newSubst arena (newdepth+1) b bind arg shift
+            alloc arena False newdepth tagLambda b' 0 0 0
+        Apply f x -> do
+            f' <- newSubst arena newdepth f bind arg shift
+            x' <- newSubst arena newdepth x bind arg shift
+            alloc arena False newdepth tagApply f' x' 0 0
+        _ -> return body
+
+fromDepth :: Arena a -> Depth.ExpNode a -> IO NodeIx
+fromDepth arena (d, n) = case n of
+    Depth.Lambda body -> do
+        body' <- fromDepth arena body
+        alloc arena False d tagLambda body' 0 0 0
+    Depth.Apply f x -> do
+        f' <- fromDepth arena f
+        x' <- fromDepth arena x
+        alloc arena False d tagApply f' x' 0 0
+    Depth.Var    -> alloc arena True d tagVar 0 0 0 0
+    Depth.Prim p -> newPrim arena d p
+
+getValue :: (HOAS.Primitive a) => Arena a -> NodeIx -> IO a
+getValue arena ix = do
+    reduce arena ix
+    node <- view arena ix
+    case node of
+        Prim x -> return x
+        _ -> fail "Not a value"
+
+evalStats :: (HOAS.Primitive a) => Thyer.Config -> Depth.Depth a -> IO (a, Stats.Stats)
+evalStats cfg t = do
+    arena <- newArena cfg
+    x <- getValue arena =<< fromDepth arena (Depth.getDepth t)
+    stats <- arenaStats arena
+    return (x, stats)
+
+eval :: (HOAS.Primitive a) => Depth.Depth a -> IO a
+eval = fmap fst . evalStats Thyer.defaultConfig
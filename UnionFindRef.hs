@@ -0,0 +1,107 @@
+{-# LANGUAGE MultiParamTypeClasses #-}
+
+-- A Ref.Store over a union-find forest.  A reference is an index into an
+-- unboxed parent array; only the roots' slots in the (boxed) contents array
+-- are meaningful, and link clears the others so that they do not keep dead
+-- nodes alive.  link is a union by size that keeps the new reference's
+-- contents, and reads find the root with iterative path halving.
+
+module UnionFindRef
+    ( Store, Ref, newStore )
+where
+
+import Prelude hiding (read)
+import qualified Ref
+import qualified Stats
+import qualified Column
+import Data.IORef
+
+data Store a = Store {
+    storeSize       :: IORef Int,
+    storeParent     :: Column.UColumn Int,
+    storeWeight     :: Column.UColumn Int,
+    storeContents   :: Column.BColumn a,
+    storeLinks      :: Stats.Counter,
+    storeChainSteps :: Stats.Counter,
+    storeMaxChain   :: Stats.Counter
+  }
+
+newtype Ref a = Ref Int
+    deriving (Eq)
+
+initialCapacity :: Int
+initialCapacity = 1024
+
+newStore :: IO (Store a)
+newStore = do
+    size <- newIORef 0
+    parent <- Column.new initialCapacity
+    weight <- Column.new initialCapacity
+    contents <- Column.new initialCapacity
+    links <- Stats.newCounter
+    steps <- Stats.newCounter
+    maxChain <- Stats.newCounter
+    return (Store size parent weight contents links steps maxChain)
+
+find :: Store a -> Int -> IO Int
+find store = go 0
+    where
+    parent = storeParent store
+    go n i = do
+        p <- Column.read parent i
+        if p == i then done n i else do
+        grandparent <- Column.read parent p
+        Column.write parent i grandparent
+        go (n+1) grandparent
+    done n root = do
+        if n == 0 then return () else do
+            Stats.tickBy n (storeChainSteps store)
+            Stats.record (storeMaxChain store) n
+        return root
+
+-- What a cell that is no longer a root holds.
+dead :: a
+dead = error "UnionFindRef: contents of a non-root cell"
+
+instance Ref.Store Store Ref where
+    new store x = do
+        i <- readIORef (storeSize store)
+        writeIORef (storeSize store) $! i + 1
+        Column.grow (storeParent store) i
+        Column.grow (storeWeight store) i
+        Column.grow (storeContents store) i
+        Column.write (storeParent store) i i
+        Column.write (storeWeight store) i 1
+        Column.write (storeContents store) i x
+        return (Ref i)
+    read store (Ref i) = Column.read (storeContents store) =<< find store i
+    write store (Ref i) x = do
+        root <- find store i
+        Column.write (storeContents store) root x
+    link store (Ref old) (Ref new) = do
+        Stats.tick (storeLinks store)
+        oldroot <- find store old
+        newroot <- find store new
+        if oldroot == newroot then return () else do
+        oldweight <- Column.read (storeWeight store) oldroot
+        newweight <- Column.read (storeWeight store) newroot
+        let weight = oldweight + newweight
+        if oldweight <= newweight
+            then do
+                Column.write (storeParent store) oldroot newroot
+                Column.write (storeWeight store) newroot weight
+                Column.write (storeContents store) oldroot dead
+            else do
+                Column.write (storeParent store) newroot oldroot
+                Column.write (storeWeight store) oldroot weight
+                Column.write (storeContents store) oldroot =<< Column.read (storeContents store) newroot
+                Column.write (storeContents store) newroot dead
+    resolve store (Ref i) = do
+        root <- find store i
+        return $ if root == i then Nothing else Just (Ref root)
+    stats store = do
+        size <- readIORef (storeSize store)
+        counts <- Stats.readCounters [ ("ref.links", storeLinks store)
+                                     , ("ref.chain-steps", storeChainSteps store)
+                                     , ("ref.max-chain", storeMaxChain store) ]
+        return $ ("ref.cells", size) : counts
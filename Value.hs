@@ -0,0 +1,14 @@
+-- The primitives the programs are run with: zero and successor.
+
+module Value (Value(..)) where
+
+import HOAS
+
+data Value
+    = VSucc
+    | VInt !Integer
+    deriving (Show, Read)
+
+instance Primitive Value where
+    apply VSucc (VInt x) = VInt (x+1)
+    apply x y = error $ "Type error when applying (" ++ show x ++ ") to (" ++ show y ++ ")"
@@ -0,0 +1,37 @@
+#!/usr/bin/perl
+
+use IO::CaptureOutput qw(capture_exec);
+
+if (@ARGV < 1) {
+    die <<USAGE;
+Usage: residualize.pl <program> [interp ...]
+    Residualizes <program> with thyer, then checks that the residual gives
+    what the program does under each interpreter (by default bubs, ref and
+    naive).  interps.pul, which ties its interpreter's knot with fix, is the
+    one to try.
+USAGE
+}
+
+my ($program, @interps) = @ARGV;
+
+@interps = qw(bubs ref naive) unless @interps;
+
+(my $residual = $program) =~ s/(\.pul)?$/.res/;
+
+my ($expected) = capture_exec("./vatican ref $program");
+chomp $expected;
+
+my ($stdout, $stderr, $ok) = capture_exec("./vatican --residualize $residual ref $program");
+chomp $stdout;
+die "Residualizing $program failed: $stderr" unless $ok;
+die "Residualizing $program changed its value: expecting '$expected', got '$stdout'"
+    if $stdout ne $expected;
+
+for my $interp (@interps) {
+    my ($stdout, $stderr) = capture_exec("./vatican $interp $residual");
+    chomp $stdout;
+    if ($stdout ne $expected) {
+        die "$interp on $residual: expecting '$expected', got '$stdout' $stderr";
+    }
+    print "$interp: $stdout\n";
+}